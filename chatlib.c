@@ -3,6 +3,8 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <sys/un.h>
+#include <sys/stat.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -11,31 +13,107 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#ifdef __linux__
+#include <linux/errqueue.h>
+#endif
+#include "chatlib.h"
+
+/* 旧版本头文件中可能缺少的零拷贝相关定义 */
+#ifdef __linux__
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+#ifndef IP_RECVERR
+#define IP_RECVERR 11
+#endif
+#ifndef IPV6_RECVERR
+#define IPV6_RECVERR 25
+#endif
+#endif
 
 /** ======================== 底层网络相关函数库  ================================ */
 
 
 // 创建TCP服务，返回监听文件描述符
-int createTCPServer(int port){
-    int server;
-    struct sockaddr_in serverAddr;
+int createTCPServer(char* bindaddr, int port){
+    int server = -1;
+    struct addrinfo hints, *servinfo, *p;
     int yes = 1;
 
-    /* 创建 socket */
-    if ((server = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+    //  port to string
+    char portStr[6];
+    snprintf(portStr, sizeof(portStr), "%d", port);
+
+    /* 未指定地址时，与之前一样监听所有 IPv4 地址 */
+    if (bindaddr == NULL || bindaddr[0] == '\0')
+        bindaddr = "0.0.0.0";
+
+    memset(&hints, 0x00, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;      // IPv4 && IPv6 均可
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE | AI_NUMERICHOST;
+    if (getaddrinfo(bindaddr, portStr, &hints, &servinfo) != 0)
+        return -1;
+    for (p = servinfo; p != NULL; p = p->ai_next){
+        /* 创建 socket */
+        if ((server = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1)
+            continue;
+        setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)); // 设置地址端口复用
+        /* IPv6 socket 只监听 IPv6，这样 [::] 与 0.0.0.0 可以同时监听同一端口 */
+        if (p->ai_family == AF_INET6)
+            setsockopt(server, IPPROTO_IPV6, IPV6_V6ONLY, &yes, sizeof(yes));
+        /* 绑定IP端口 && 开始监听 */
+        if (bind(server, p->ai_addr, p->ai_addrlen) == -1 || listen(server, 511) == -1){
+            close(server);
+            server = -1;
+            continue;
+        }
+        break;
+    }
+    freeaddrinfo(servinfo);
+    return server;
+}
+
+// 创建 Unix 域套接字服务，返回监听文件描述符
+int createUnixServer(char* path){
+    int server;
+    struct sockaddr_un serverAddr;
+    struct stat st;
+
+    if (strlen(path) >= sizeof(serverAddr.sun_path)){
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    if ((server = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
         return -1;
-    setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)); // 设置地址端口复用
-    /* 初始化服务端信息 */
     memset(&serverAddr, 0x00, sizeof(serverAddr));
-    serverAddr.sin_family = AF_INET;
-    serverAddr.sin_port = htons(port);
-    serverAddr.sin_addr.s_addr = htonl(INADDR_ANY);
-    /* 绑定IP端口 */
+    serverAddr.sun_family = AF_UNIX;
+    strcpy(serverAddr.sun_path, path);
+    /* 上次运行残留的 socket 文件会使 bind 失败，需要先删除:
+     * 只删除无人监听(连接被拒绝)的 socket 文件，其他类型的文件或仍在服务的 socket 按地址被占用处理 */
+    if (lstat(path, &st) == 0){
+        int probe, stale = 0;
+        if (S_ISSOCK(st.st_mode) && (probe = socket(AF_UNIX, SOCK_STREAM, 0)) != -1){
+            // 非阻塞探测，对方 backlog 已满时不会卡住启动
+            fcntl(probe, F_SETFL, O_NONBLOCK);
+            stale = connect(probe, (struct sockaddr*)&serverAddr, sizeof(serverAddr)) == -1 && errno == ECONNREFUSED;
+            close(probe);
+        }
+        if (!stale){
+            close(server);
+            errno = EADDRINUSE;
+            return -1;
+        }
+        unlink(path);
+    }
     if (bind(server, (struct sockaddr*)&serverAddr, sizeof(serverAddr)) == -1){
         close(server);
         return -1;
     }
-    /* 开始监听 */
     if (listen(server, 511) == -1){
         close(server);
         return -1;
@@ -55,18 +133,51 @@ int socketSetNonBlockNoDelay(int sockfd){
     if(fcntl(sockfd,F_SETFL, flags | O_NONBLOCK) == -1){
         return -1;
     }
-    /* 启用无延迟特性 */
-    if (setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay)) == -1){
+    /* 启用无延迟特性，Unix 域套接字不支持该选项，忽略即可 */
+    if (setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay)) == -1 && errno != EOPNOTSUPP){
         return -1;
     }
     return 0;
 }
 
+// 连接到指定路径的 Unix 域套接字,成功时返回套接字描述符，否则返回-1
+int UnixConnect(char* path, int nonblock){
+    int server;
+    struct sockaddr_un serverAddr;
+
+    if (strlen(path) >= sizeof(serverAddr.sun_path)){
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    if ((server = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+        return -1;
+    if (nonblock && socketSetNonBlockNoDelay(server) == -1){
+        close(server);
+        return -1;
+    }
+    memset(&serverAddr, 0x00, sizeof(serverAddr));
+    serverAddr.sun_family = AF_UNIX;
+    strcpy(serverAddr.sun_path, path);
+    if (connect(server, (struct sockaddr*)&serverAddr, sizeof(serverAddr)) == -1){
+        if (errno == EINPROGRESS && nonblock)
+            return server;
+        close(server);
+        return -1;
+    }
+    return server;
+}
+
 // 创建一个 TCP 套接字并将其连接到指定地址,成功时返回套接字描述符，否则返回-1
 int TCPConnect(char* addr, int port, int nonblock){
     int server, retval = -1;
     struct addrinfo hints, *servinfo, *p;
 
+    /* "unix:/path" 或 "/path" 形式的地址，连接本机 Unix 域套接字 */
+    if (strncmp(addr, "unix:", 5) == 0)
+        return UnixConnect(addr + 5, nonblock);
+    if (addr[0] == '/')
+        return UnixConnect(addr, nonblock);
+
     //  port to string
     char portStr[6];
     snprintf(portStr, sizeof(portStr), "%d", port);
@@ -82,19 +193,21 @@ int TCPConnect(char* addr, int port, int nonblock){
     /* 一个主机可能存在多个IP，所以结构为链表结构，循环尝试连接其中任何一个IP地址，直到成功或全部失败; */
     for (p = servinfo; p != NULL; p = p->ai_next){
         if ((server = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1)
-            return -1;
+            continue;
         
         /* 如果需要，就设置为非阻塞 */
         if(nonblock && socketSetNonBlockNoDelay(server) == -1){
             close(server);
-            break;
+            continue;
         }
-        /* 尝试连接服务端 */
+        /* 尝试连接服务端，失败则继续尝试下一个地址(例如 IPv6 失败后尝试 IPv4) */
         if(connect(server, p->ai_addr, p->ai_addrlen) == -1){
-            if (errno == EINPROGRESS && nonblock)
-                return server;
+            if (errno == EINPROGRESS && nonblock){
+                retval = server;
+                break;
+            }
             close(server);
-            break;
+            continue;
         }
         /* 连接至服务端成功 */
         retval = server;
@@ -115,8 +228,8 @@ int TCPConnect(char* addr, int port, int nonblock){
 int acceptClient(int server_socket){
     int client_fd;
     while (1){
-        // 客户端信息载体
-        struct sockaddr_in client;
+        // 客户端信息载体，足以容纳 IPv4 / IPv6 / Unix 地址
+        struct sockaddr_storage client;
         socklen_t  clen = sizeof(client);
         // 等待客户端连接
         client_fd = accept(server_socket, (struct sockaddr*)&client, &clen);
@@ -172,6 +285,152 @@ reset:
     return n;
 }
 
+/** ======================== 零拷贝发送  ================================ */
+
+/**
+ * 创建共享缓冲区，初始引用计数为1
+ */
+sharedBuf* sharedBufCreate(const void* data, size_t len){
+    sharedBuf* buf = chatMalloc(sizeof(*buf) + len);
+    buf->refcount = 1;
+    buf->len = len;
+    memcpy(buf->data, data, len);
+    return buf;
+}
+
+sharedBuf* sharedBufRetain(sharedBuf* buf){
+    buf->refcount++;
+    return buf;
+}
+
+void sharedBufRelease(sharedBuf* buf){
+    if (--buf->refcount == 0)
+        free(buf);
+}
+
+/**
+ * 开启 socket 的零拷贝发送，Unix 域套接字及旧内核会失败
+ */
+int zeroCopyEnable(int fd, zeroCopyState* zc){
+    memset(zc, 0, sizeof(*zc));
+#ifdef __linux__
+    int yes = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &yes, sizeof(yes)) == -1)
+        return -1;
+    zc->enabled = 1;
+    return 0;
+#else
+    (void)fd;
+    return -1;
+#endif
+}
+
+/**
+ * 使用 MSG_ZEROCOPY 发送缓冲区，内核只锁定用户页而不拷贝数据，
+ * 因此在收到完成通知之前必须保持缓冲区有效.
+ */
+ssize_t zeroCopySend(int fd, zeroCopyState* zc, sharedBuf* buf){
+#ifdef __linux__
+    ssize_t n;
+    struct iovec iov;
+    struct msghdr msg;
+
+    // 未启用或等待队列已满，退化为普通写
+    if (!zc->enabled || zc->count == ZEROCOPY_MAX_PENDING)
+        return Write(fd, buf->data, buf->len);
+
+    iov.iov_base = buf->data;
+    iov.iov_len = buf->len;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+reset:
+    if ((n = sendmsg(fd, &msg, MSG_ZEROCOPY | MSG_NOSIGNAL)) == -1){
+        switch (errno){
+        case EINTR:
+            goto reset;
+        case ENOBUFS:
+            // 超出锁定内存限制(optmem)，本次退化为普通写
+            return Write(fd, buf->data, buf->len);
+        }
+        return -1;
+    }
+    // 发送成功才会消耗一个序号
+    zc->pending[zc->count].id = zc->next_id++;
+    zc->pending[zc->count].buf = sharedBufRetain(buf);
+    zc->count++;
+    return n;
+#else
+    (void)zc;
+    return Write(fd, buf->data, buf->len);
+#endif
+}
+
+/**
+ * 处理错误队列中的零拷贝完成通知.
+ * 每个通知携带一个已完成的序号区间 [ee_info, ee_data]，区间内的缓冲区可以释放;
+ * 若通知带有 SO_EE_CODE_ZEROCOPY_COPIED 表示内核实际还是拷贝了数据(例如回环网卡)，
+ * 连续多次如此说明零拷贝只有额外开销，此时关闭零拷贝.
+ */
+int zeroCopyReap(int fd, zeroCopyState* zc){
+    int released = 0;
+#ifdef __linux__
+    char control[128];
+    struct msghdr msg;
+    struct cmsghdr *cm;
+    struct sock_extended_err *serr;
+
+    while (zc->count > 0){
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1){
+            if (errno == EINTR)
+                continue;
+            // EAGAIN: 暂时没有更多通知
+            break;
+        }
+        for (cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)){
+            if (!((cm->cmsg_level == IPPROTO_IP && cm->cmsg_type == IP_RECVERR) ||
+                  (cm->cmsg_level == IPPROTO_IPV6 && cm->cmsg_type == IPV6_RECVERR)))
+                continue;
+            serr = (struct sock_extended_err*)CMSG_DATA(cm);
+            if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+            // 释放区间内的缓冲区，保持剩余项的发送顺序
+            uint32_t lo = serr->ee_info, hi = serr->ee_data;
+            if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                zc->copied += hi - lo + 1;
+            else
+                zc->copied = 0;
+            int j, k = 0;
+            for (j = 0; j < zc->count; j++){
+                if (zc->pending[j].id - lo <= hi - lo){
+                    sharedBufRelease(zc->pending[j].buf);
+                    released++;
+                }else{
+                    zc->pending[k++] = zc->pending[j];
+                }
+            }
+            zc->count = k;
+        }
+    }
+    if (zc->enabled && zc->copied >= ZEROCOPY_COPIED_LIMIT)
+        zc->enabled = 0;
+#else
+    (void)fd;
+    (void)zc;
+#endif
+    return released;
+}
+
+void zeroCopyReset(zeroCopyState* zc){
+    for (int j = 0; j < zc->count; j++)
+        sharedBufRelease(zc->pending[j].buf);
+    zc->count = 0;
+    zc->enabled = 0;
+}
+
 /**
  * 自定义内存分配函数,当内存不足时，则程序直接结束;
  * @param size 要分配的内存大小
@@ -4,6 +4,7 @@
 #define CHATLIB_H
 #include <stdio.h>
 #include <sys/types.h>
+#include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -13,19 +14,35 @@ extern "C" {
     /**
      * 创建TCP服务，并且返回服务socket描述符，失败返回-1.
      * 
+     * @param bindaddr: 监听的 IPv4/IPv6 地址, NULL 表示所有 IPv4 地址
      * @param port: 服务使用的端口号
      */
-    int createTCPServer(int port);
+    int createTCPServer(char* bindaddr, int port);
+
+    /**
+     * 创建 Unix 域套接字服务，并且返回服务socket描述符，失败返回-1.
+     * 
+     * @param path: socket 文件路径, 无人监听的残留 socket 文件会被删除，其他已存在的文件视为地址被占用
+     */
+    int createUnixServer(char* path);
 
     /**
      * 与指定地址建立 TCP 连接, 并且返回连接 socket 描述符，失败返回-1.
      * 
-     * @param addr: TCP服务端地址
+     * @param addr: TCP服务端地址, "unix:/path" 或 "/path" 则连接 Unix 域套接字
      * @param port: TCP服务端口
      * @param nonblock: 非阻塞模式标志
      */
     int TCPConnect(char* addr, int port, int nonblock);
 
+    /**
+     * 与指定路径的 Unix 域套接字建立连接, 并且返回连接 socket 描述符，失败返回-1.
+     * 
+     * @param path: socket 文件路径
+     * @param nonblock: 非阻塞模式标志
+     */
+    int UnixConnect(char* path, int nonblock);
+
     /**
      * 阻塞从服务中接收一个TCP连接，并返回该连接的 socket 描述符，失败返回-1.
      * 
@@ -45,6 +62,66 @@ extern "C" {
 
 
 
+    /* ===================== Zero copy ===================== */
+
+    /**
+     * 引用计数的共享消息缓冲区，同一条消息发送给多个客户端时只保存一份，
+     * 零拷贝发送时需要等待内核使用完毕后才能释放.
+     */
+    typedef struct sharedBuf {
+        int refcount;   // 引用计数，为 0 时释放
+        size_t len;     // 数据长度
+        char data[];    // 消息数据
+    } sharedBuf;
+
+    /* 创建共享缓冲区(引用计数为1)，并拷贝数据 */
+    sharedBuf* sharedBufCreate(const void* data, size_t len);
+    /* 增加引用计数 */
+    sharedBuf* sharedBufRetain(sharedBuf* buf);
+    /* 减少引用计数，为 0 时释放 */
+    void sharedBufRelease(sharedBuf* buf);
+
+    // 每个 socket 最多等待内核完成通知的零拷贝发送数量
+    #define ZEROCOPY_MAX_PENDING 64
+    // 连续多少次被内核回退为拷贝后，关闭该 socket 的零拷贝
+    #define ZEROCOPY_COPIED_LIMIT 16
+
+    /**
+     * 单个 socket 的 MSG_ZEROCOPY 发送状态.
+     * 内核按发送顺序为每次零拷贝发送分配一个递增序号，完成后通过 socket 错误队列通知.
+     */
+    typedef struct zeroCopyState {
+        int enabled;        // 是否启用零拷贝
+        uint32_t next_id;   // 下一次零拷贝发送的序号
+        int copied;         // 连续被内核回退为拷贝的次数
+        int count;          // 等待完成通知的发送数量
+        struct {
+            uint32_t id;
+            sharedBuf* buf;
+        } pending[ZEROCOPY_MAX_PENDING];
+    } zeroCopyState;
+
+    /**
+     * 为 socket 开启 SO_ZEROCOPY，成功返回0，内核或协议不支持返回-1 (此时发送退化为普通写).
+     */
+    int zeroCopyEnable(int fd, zeroCopyState* zc);
+
+    /**
+     * 发送共享缓冲区数据，启用时使用 MSG_ZEROCOPY 并持有缓冲区引用直到内核完成通知，
+     * 否则退化为普通写. 返回值与 Write 一致.
+     */
+    ssize_t zeroCopySend(int fd, zeroCopyState* zc, sharedBuf* buf);
+
+    /**
+     * 读取 socket 错误队列中的完成通知，释放内核已用完的缓冲区，返回释放的数量.
+     * 内核持续回退为拷贝时自动关闭零拷贝.
+     */
+    int zeroCopyReap(int fd, zeroCopyState* zc);
+
+    /* 释放所有未完成的缓冲区引用，只能在内核不再使用这些缓冲区后调用(已收齐完成通知或发送队列已被丢弃) */
+    void zeroCopyReset(zeroCopyState* zc);
+
+
     /* ===================== Allocation ===================== */
     /* 自定义内存分配函数 */
     void* chatMalloc(size_t size);
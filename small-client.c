@@ -18,8 +18,13 @@
 #include<stdlib.h>
 #include<unistd.h>
 #include<sys/select.h>
+#include<sys/time.h>
+#include<sys/stat.h>
+#include<sys/uio.h>
+#include<fcntl.h>
 #include<termios.h>
 #include<errno.h>
+#include<stdarg.h>
 #include "chatlib.h"
 
 
@@ -191,20 +196,412 @@ int inputBufferFeedChar(struct InputBuffer *buffer, int c){
     return BUF_OK;
 }
 
+/* ============================================================================
+ * Session && reconnect
+ * ========================================================================== */
+
+#define RECONNECT_MIN_MS 100     // 首次重连等待时间
+#define RECONNECT_MAX_MS 5000    // 重连等待时间上限(每次失败翻倍)
+#define RECONNECT_MAX_TRIES 20   // 连续重连失败次数上限
+
+/**
+ * 会话状态，断线重连时凭 token 与最后收到的序号恢复
+ */
+struct Session {
+    char token[64];                 // 服务端下发的会话 token，空字符串表示尚未建立
+    unsigned long long last_seq;    // 已收到的最后一条消息序号
+    int resuming;                   // 正在恢复会话，忽略重连时服务端的欢迎信息
+};
+
+/**
+ * 服务端数据缓冲区，按行/帧解析服务端发来的数据:
+ *  - ":<seq> <len>\n<payload>"  带序号的消息
+ *  - "!<control>\n"             会话控制消息
+ *  - 其他                       普通文本(建立会话之前的消息)
+ */
+struct ReplyBuffer {
+    char *buf;
+    size_t len;
+    size_t cap;
+    int line_start;     // 当前是否位于行首
+};
+
+/**
+ * 建立连接后发起会话: 首次连接创建会话，重连时恢复会话
+ */
+void sessionHandshake(int server, struct Session *session){
+    char cmd[128];
+    int len;
+    session->resuming = session->token[0] != 0;
+    if (session->token[0] == 0)
+        len = snprintf(cmd, sizeof(cmd), "/session\n");
+    else
+        len = snprintf(cmd, sizeof(cmd), "/resume %s %llu\n", session->token, session->last_seq);
+    write(server, cmd, len);
+}
+
+/**
+ * 处理一条会话控制消息
+ */
+void sessionControl(int server, struct Session *session, char *line){
+    char *msg = NULL;
+    unsigned long long from, to;
+    char notice[96];
+
+    if (!strncmp(line, "!session ", 9)){
+        snprintf(session->token, sizeof(session->token), "%s", line + 9);
+        session->last_seq = 0;
+    }else if (!strncmp(line, "!resumed", 8)){
+        session->resuming = 0;
+        msg = "[session resumed]\n";
+    }else if (sscanf(line, "!gap %llu %llu", &from, &to) == 2){
+        snprintf(notice, sizeof(notice), "[missed messages %llu-%llu]\n", from, to);
+        msg = notice;
+    }else if (!strcmp(line, "!expired")){
+        // 会话已过期，以新用户身份重新加入
+        msg = "[session expired, joined as a new user]\n";
+        session->token[0] = 0;
+        session->last_seq = 0;
+        sessionHandshake(server, session);
+    }
+    if (msg)
+        write(fileno(stdout), msg, strlen(msg));
+}
+
+/* ============================================================================
+ * File transfer
+ * ========================================================================== */
+
+#define CHUNK_SIZE (16 * 1024)   // 每个数据块的最大长度
+#define MAX_INCOMING 8           // 最多同时接收的文件数
+
+/**
+ * 正在发送的文件，同一时间只发送一个
+ */
+struct OutgoingFile {
+    int fd;                 // 文件描述符，-1 表示没有发送中的文件
+    int id;                 // 服务端分配的传输 id，0 表示等待服务端确认
+    size_t window;          // 未确认字节数上限
+    size_t unacked;         // 已发送但未被确认的字节数
+    unsigned long long left;// 剩余未发送字节数
+};
+
+/**
+ * 正在接收的文件
+ */
+struct IncomingFile {
+    int id;                 // 传输 id，0 表示空闲
+    int fd;
+    char path[136];         // 保存路径: "recv-" + 文件名
+};
+
+static struct OutgoingFile Outgoing = { .fd = -1 };
+static struct IncomingFile Incoming[MAX_INCOMING];
+
+/**
+ * 向终端输出一条提示
+ */
+void notice(char *fmt, ...){
+    char msg[256];
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(msg, sizeof(msg), fmt, ap);
+    va_end(ap);
+    if (len >= (int)sizeof(msg)) len = sizeof(msg) - 1;
+    write(fileno(stdout), msg, len);
+}
+
+/**
+ * 阻塞写入全部数据
+ */
+int writeAll(int fd, struct iovec *iov, int iovcnt){
+    while (iovcnt > 0){
+        ssize_t n = writev(fd, iov, iovcnt);
+        if (n == -1){
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len){
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0){
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+/**
+ * 结束发送
+ */
+void outgoingClose(void){
+    if (Outgoing.fd != -1)
+        close(Outgoing.fd);
+    Outgoing.fd = -1;
+    Outgoing.id = 0;
+}
+
+/**
+ * 处理 /send <nick> <file>: 打开文件，向服务端发起传输
+ */
+void outgoingStart(int server, char *args){
+    char *nick = args, *path, *name;
+    struct stat st;
+    char cmd[256];
+
+    if (Outgoing.fd != -1){
+        notice("[a file transfer is already in progress]\n");
+        return;
+    }
+    if ((path = strchr(nick, ' ')) == NULL){
+        notice("[usage: /send <nick> <file>]\n");
+        return;
+    }
+    *path++ = 0;
+    if ((Outgoing.fd = open(path, O_RDONLY)) == -1 || fstat(Outgoing.fd, &st) == -1 || st.st_size == 0){
+        notice("[can not send %s]\n", path);
+        outgoingClose();
+        return;
+    }
+    name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+    Outgoing.id = 0;
+    Outgoing.unacked = 0;
+    Outgoing.left = st.st_size;
+    int len = snprintf(cmd, sizeof(cmd), "/send %s %llu %s\n", nick, Outgoing.left, name);
+    write(server, cmd, len);
+    notice("[sending %s (%llu bytes) to %s]\n", name, Outgoing.left, nick);
+}
+
+/**
+ * 在窗口允许的范围内继续发送数据块
+ */
+void outgoingPump(int server){
+    static char chunk[CHUNK_SIZE];
+    while (Outgoing.fd != -1 && Outgoing.id && Outgoing.left > 0){
+        size_t want = Outgoing.left < CHUNK_SIZE ? Outgoing.left : CHUNK_SIZE;
+        if (Outgoing.unacked + want > Outgoing.window)
+            break;
+        ssize_t n = read(Outgoing.fd, chunk, want);
+        if (n <= 0){
+            // 文件被截断，无法继续; 通知服务端中止，接收方才不会一直等待
+            char cmd[64];
+            int cmd_len = snprintf(cmd, sizeof(cmd), "/chunk-abort %d\n", Outgoing.id);
+            struct iovec iov = { .iov_base = cmd, .iov_len = cmd_len };
+            writeAll(server, &iov, 1);
+            notice("[read error, transfer aborted]\n");
+            outgoingClose();
+            break;
+        }
+        char header[64];
+        int header_len = snprintf(header, sizeof(header), "/chunk %d %zd\n", Outgoing.id, n);
+        struct iovec iov[2] = {
+            { .iov_base = header, .iov_len = header_len },
+            { .iov_base = chunk, .iov_len = n },
+        };
+        if (writeAll(server, iov, 2) == -1)
+            break;
+        Outgoing.unacked += n;
+        Outgoing.left -= n;
+    }
+}
+
+struct IncomingFile* incomingFind(int id){
+    for (int j = 0; j < MAX_INCOMING; j++){
+        if (Incoming[j].id == id)
+            return &Incoming[j];
+    }
+    return NULL;
+}
+
+void incomingClose(struct IncomingFile *in){
+    close(in->fd);
+    in->id = 0;
+}
+
+/**
+ * 连接断开时，进行中的传输全部中止
+ */
+void transferReset(void){
+    if (Outgoing.fd != -1){
+        notice("[file transfer interrupted]\n");
+        outgoingClose();
+    }
+    for (int j = 0; j < MAX_INCOMING; j++){
+        if (Incoming[j].id){
+            notice("[receiving %s interrupted]\n", Incoming[j].path);
+            incomingClose(&Incoming[j]);
+        }
+    }
+}
+
+/**
+ * 处理文件传输相关的控制消息，不是传输消息返回0
+ */
+int transferControl(int server, char *line){
+    int id;
+    size_t n;
+    char from[64], name[128];
+    unsigned long long size;
+    struct IncomingFile *in;
+
+    if (sscanf(line, "!send %d %zu", &id, &n) == 2){
+        Outgoing.id = id;
+        Outgoing.window = n;
+        outgoingPump(server);
+    }else if (sscanf(line, "!ack %d %zu", &id, &n) == 2){
+        if (id == Outgoing.id){
+            Outgoing.unacked -= n;
+            outgoingPump(server);
+        }
+    }else if (sscanf(line, "!send-done %d", &id) == 1){
+        notice("[file sent]\n");
+        outgoingClose();
+    }else if (!strncmp(line, "!send-error ", 12)){
+        notice("[send failed: %s]\n", line + 12);
+        outgoingClose();
+    }else if (sscanf(line, "!send-abort %d", &id) == 1){
+        if (id == Outgoing.id){
+            notice("[file transfer aborted]\n");
+            outgoingClose();
+        }
+    }else if (sscanf(line, "!file %d %63s %llu %127[^\n]", &id, from, &size, name) == 4){
+        if ((in = incomingFind(0)) == NULL){
+            notice("[too many incoming files, ignore %s from %s]\n", name, from);
+            return 1;
+        }
+        // 只保留文件名部分，保存到当前目录
+        char *base = strrchr(name, '/') ? strrchr(name, '/') + 1 : name;
+        snprintf(in->path, sizeof(in->path), "recv-%s", base);
+        if ((in->fd = open(in->path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1){
+            notice("[can not create %s]\n", in->path);
+            return 1;
+        }
+        in->id = id;
+        notice("[receiving %s (%llu bytes) from %s]\n", name, size, from);
+    }else if (sscanf(line, "!file-done %d", &id) == 1){
+        if ((in = incomingFind(id)) != NULL){
+            notice("[file saved to %s]\n", in->path);
+            incomingClose(in);
+        }
+    }else if (sscanf(line, "!file-abort %d", &id) == 1){
+        if ((in = incomingFind(id)) != NULL){
+            notice("[receiving %s aborted]\n", in->path);
+            incomingClose(in);
+        }
+    }else{
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * 将服务端数据追加到缓冲区
+ */
+void replyBufferAppend(struct ReplyBuffer *rb, char *data, size_t len){
+    if (rb->len + len > rb->cap){
+        rb->cap = (rb->len + len) * 2;
+        rb->buf = chatRealloc(rb->buf, rb->cap);
+    }
+    memcpy(rb->buf + rb->len, data, len);
+    rb->len += len;
+}
+
+/**
+ * 解析缓冲区中所有完整的消息并输出到终端，不完整的部分留待下次读取
+ */
+void replyBufferProcess(struct ReplyBuffer *rb, int server, struct Session *session){
+    size_t pos = 0;
+    while (pos < rb->len){
+        char *p = rb->buf + pos;
+        size_t avail = rb->len - pos;
+        char *eol = memchr(p, '\n', avail);
+
+        if (rb->line_start && (p[0] == ':' || p[0] == '!')){
+            // 头部不完整，等待更多数据
+            if (eol == NULL)
+                break;
+            size_t header_len = eol - p + 1;
+            if (!strncmp(p, "!data ", 6)){
+                // 文件数据帧: "!data <id> <len>\n<len 字节>"
+                int id;
+                size_t len;
+                if (sscanf(p, "!data %d %zu", &id, &len) != 2){
+                    pos += header_len;
+                    continue;
+                }
+                if (avail < header_len + len)
+                    break;
+                struct IncomingFile *in = incomingFind(id);
+                if (in && write(in->fd, p + header_len, len) != (ssize_t)len){
+                    notice("[write %s failed]\n", in->path);
+                    incomingClose(in);
+                }
+                pos += header_len + len;
+                continue;
+            }
+            if (p[0] == '!'){
+                *eol = 0;
+                if (!transferControl(server, p))
+                    sessionControl(server, session, p);
+                pos += header_len;
+                continue;
+            }
+            unsigned long long seq;
+            size_t len;
+            if (sscanf(p, ":%llu %zu", &seq, &len) != 2){
+                pos += header_len;
+                continue;
+            }
+            if (avail < header_len + len)
+                break;
+            // 重放时可能收到已经显示过的消息
+            if (seq > session->last_seq){
+                write(fileno(stdout), p + header_len, len);
+                session->last_seq = seq;
+            }
+            pos += header_len + len;
+            continue;
+        }
+        // 普通文本，输出到行尾
+        size_t n = eol ? (size_t)(eol - p + 1) : avail;
+        if (!session->resuming)
+            write(fileno(stdout), p, n);
+        rb->line_start = eol != NULL;
+        pos += n;
+    }
+    memmove(rb->buf, rb->buf + pos, rb->len - pos);
+    rb->len -= pos;
+}
+
 /**
  * Client main.
  */
 int main(int argc, char **args){
-    if (argc != 3){
+    if (argc != 3 && argc != 2){
         printf("Usage: %s <host> <port>\n", args[0]);
+        printf("       %s unix:<path>\n", args[0]);
         exit(1);
     }
-    // 与服务端建立TCP连接
-    int server = TCPConnect(args[1], atoi(args[2]), 0);
+    // 与服务端建立TCP连接 (或 Unix 域套接字连接)
+    char *addr = args[1];
+    int port = argc == 3 ? atoi(args[2]) : 0;
+    int server = TCPConnect(addr, port, 0);
     if (server == -1){
         perror("Connecting to server");
         exit(1);
     }
+    // 开启会话，断线后可以恢复
+    struct Session session = { .token = "", .last_seq = 0, .resuming = 0 };
+    struct ReplyBuffer replies = { .buf = NULL, .len = 0, .cap = 0, .line_start = 1 };
+    sessionHandshake(server, &session);
+    // 重连状态
+    int reconnect_tries = 0;
+    int reconnect_ms = RECONNECT_MIN_MS;
+    // 用户输入了 exit，连接关闭后直接退出
+    int exiting = 0;
 
     /* 将终端标准输入，设置为原始模式.
      *  - 即无缓冲区，每次单击事件都能收到.
@@ -220,28 +617,66 @@ int main(int argc, char **args){
     int stdin_fd = fileno(stdin);
     while (1){
         FD_ZERO(&listen_fds);
-        FD_SET(server, &listen_fds);
+        if (server != -1)
+            FD_SET(server, &listen_fds);
         FD_SET(stdin_fd, &listen_fds);
         int max_fd = server > stdin_fd ? server : stdin_fd;
-        int num_evnets = select(max_fd + 1, &listen_fds, NULL, NULL, NULL);
+        // 断线期间，select 超时后尝试重连
+        struct timeval timeout, *tvp = NULL;
+        if (server == -1){
+            timeout.tv_sec = reconnect_ms / 1000;
+            timeout.tv_usec = (reconnect_ms % 1000) * 1000;
+            tvp = &timeout;
+        }
+        int num_evnets = select(max_fd + 1, &listen_fds, NULL, NULL, tvp);
         if (num_evnets == -1){
+            if (errno == EINTR)
+                continue;
             perror("client select error");
             exit(1);
+        }else if (num_evnets == 0 && server == -1){
+            // 重连，失败则加倍等待时间
+            if ((server = TCPConnect(addr, port, 0)) == -1){
+                if (++reconnect_tries >= RECONNECT_MAX_TRIES){
+                    printf("Connection exit.\n");
+                    exit(1);
+                }
+                reconnect_ms = reconnect_ms * 2 > RECONNECT_MAX_MS ? RECONNECT_MAX_MS : reconnect_ms * 2;
+                continue;
+            }
+            reconnect_tries = 0;
+            reconnect_ms = RECONNECT_MIN_MS;
+            replies.len = 0;
+            replies.line_start = 1;
+            sessionHandshake(server, &session);
         }else if (num_evnets){
             // 有io事件就绪
             char lines[128];
 
             // 服务端事件就绪
-            if (FD_ISSET(server, &listen_fds)){
-                ssize_t n = read(server, lines, sizeof(lines));
+            if (server != -1 && FD_ISSET(server, &listen_fds)){
+                char reply[16 * 1024];
+                ssize_t n = read(server, reply, sizeof(reply));
                 if (n <= 0){
-                    printf("Connection exit.\n");
-                    exit(1);
+                    if (exiting){
+                        printf("Connection exit.\n");
+                        exit(0);
+                    }
+                    // 连接断开，稍后重连并恢复会话
+                    close(server);
+                    server = -1;
+                    inputBufferHide(&buffer);
+                    printf("[connection lost, reconnecting...]\n");
+                    fflush(stdout);
+                    transferReset();
+                    inputBufferShow(&buffer);
+                    continue;
                 }
                 // 清除当前行内容，输出服务端数据
                 // 然后将缓冲区数据，输出到下一行
                 inputBufferHide(&buffer);
-                write(fileno(stdout), lines, n);
+                replyBufferAppend(&replies, reply, n);
+                replyBufferProcess(&replies, server, &session);
                 inputBufferShow(&buffer);
             }else if (FD_ISSET(stdin_fd, &listen_fds)){
                 // 终端标准输入事件就绪
@@ -258,9 +693,24 @@ int main(int argc, char **args){
                         // 将缓冲区数据 输出到终端 && 发送给服务端
                         inputBufferAppend(&buffer, '\n');
                         inputBufferHide(&buffer);
+                        if (server == -1){
+                            char *offline = "[offline, message not sent]\n";
+                            write(fileno(stdout), offline, strlen(offline));
+                            inputBufferClear(&buffer);
+                            break;
+                        }
                         write(fileno(stdout), "you> ", 5);
                         write(fileno(stdout), buffer.buf, buffer.len);
+                        if (buffer.len > 6 && !strncmp(buffer.buf, "/send ", 6)){
+                            // 发送文件: /send <nick> <file>，由客户端读取文件分块发送
+                            buffer.buf[buffer.len - 1] = 0;
+                            outgoingStart(server, buffer.buf + 6);
+                            inputBufferClear(&buffer);
+                            break;
+                        }
                         write(server, buffer.buf, buffer.len);
+                        if (buffer.len == 5 && !strncmp(buffer.buf, "exit\n", 5))
+                            exiting = 1;
                         inputBufferClear(&buffer);
                         break;
                     case BUF_OK:
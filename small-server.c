@@ -6,23 +6,91 @@
  *  - 将消息转发给其他客户端
  */
 
+#define _GNU_SOURCE
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <assert.h>
 #include <errno.h>
 #include <sys/select.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#ifdef __linux__
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#endif
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 
 #include "chatlib.h"
 #include "log.h"
 
 // 最大客户端连接数
 #define MAX_CLIENTS 1000
-// 服务端口 
+// 默认服务端口 
 #define SERVER_PORT 7711
+// 最大监听端点数
+#define MAX_LISTENERS 16
 // 客户端关闭指令
 #define EXIT "exit\n"
 
+// 在线列表快照头部预留空间
+#define PRESENCE_HEADER_MAX 32
+
+// 会话 token 长度(十六进制字符)
+#define SESSION_TOKEN_LEN 16
+// 每个会话保留的最近消息数，用于断线重连后重放
+#define SESSION_BACKLOG 64
+// 最大会话数(包括已断开等待恢复的会话)
+#define MAX_SESSIONS 1024
+// 断开的会话保留时长(秒)，超时后视为退出
+#define SESSION_TIMEOUT 60
+// 新连接在未发送任何数据时，延迟多久公告其加入(微秒)
+#define CLIENT_ANNOUNCE_DELAY 500000
+
+// 关闭时仍有零拷贝发送未完成的连接，最多等待完成通知多久(秒)，超时后强制中断连接
+#define ZEROCOPY_LINGER_TIMEOUT 30
+
+// 单行输入的最大长度，超过后不再等待换行，已收到的部分按一行处理
+#define CLIENT_MAX_LINE (64 * 1024)
+
+// 单个客户端输出队列上限，超过后视为慢客户端并断开连接
+#define CLIENT_OUTPUT_LIMIT (4 * 1024 * 1024)
+
+// 最大同时进行的文件传输数
+#define MAX_TRANSFERS 256
+// 文件传输窗口: 发送方最多可以有多少字节未被确认，不超过管道容量
+#define TRANSFER_WINDOW (64 * 1024)
+
+// 延迟直方图: 每个 2 的幂区间划分的桶数(2^LATENCY_SUB_BITS)，以及总桶数
+#define LATENCY_SUB_BITS 4
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BITS)
+#define LATENCY_BUCKETS (64 * LATENCY_SUB_BUCKETS)
+// 延迟分位数输出周期(秒)
+#define LATENCY_REPORT_INTERVAL 10
+// 低延迟模式参数: SO_BUSY_POLL 时长(微秒)，预先缺页的堆/栈大小
+#define LATENCY_BUSY_POLL_US 50
+#define LATENCY_PREFAULT_HEAP (64 * 1024 * 1024)
+#define LATENCY_PREFAULT_STACK (256 * 1024)
+// epoll_wait 每次最多返回的事件数
+#define MAX_EVENTS 128
+
+// 捕获文件头
+#define CAPTURE_MAGIC "SCAP1"
+// 捕获事件类型: 建立连接 / 收到数据 / 连接关闭
+#define CAPTURE_CONNECT 1
+#define CAPTURE_INPUT   2
+#define CAPTURE_CLOSE   3
+// 文件传输数据直接 splice 进管道，只记录长度
+#define CAPTURE_SPLICE  4
+// 处理上一条输入时生成的会话 token，回放时沿用，使 /resume 与录制时一致
+#define CAPTURE_TOKEN   5
+
 // 服务端全局状态数据，启动时由`initChat`函数初始化
 struct chatState *Chat;
 
@@ -33,20 +101,517 @@ struct client{
     int fd;         
     // client name
     char *nick_name;
+    // MSG_ZEROCOPY 发送状态
+    zeroCopyState zc;
+    // 是否订阅在线列表变更
+    int presence_sub;
+    // 所属会话，NULL 表示未开启会话
+    struct session *session;
+    // 是否已公告加入(新连接可能是断线重连，延迟公告)
+    int announced;
+    // 建立连接的时间(微秒)
+    uint64_t connected_us;
+    // 输出队列，socket 暂时不可写时保存待发送数据，保证消息顺序
+    struct outItem *out_head, *out_tail;
+    // 输出队列中内存数据的字节数
+    size_t out_bytes;
+    // 是否已在事件循环中注册可写 / 可读事件
+    int want_write;
+    int want_read;
+    // 暂停读取: 正在接收的数据块所属传输管道已满
+    int read_paused;
+    // 输出队列超限，等待事件循环关闭，不再向其写入数据
+    int close_asap;
+    // 输入缓冲区，按行切分，不完整的行留到下次读取
+    char *in_buf;
+    size_t in_len;
+    size_t in_cap;
+    // 正在接收的数据块所属传输(NULL 表示丢弃数据)，以及剩余字节数
+    struct transfer *chunk_transfer;
+    size_t chunk_left;
+};
+
+/* 客户端输出队列中的一项: 内存数据，或文件传输管道中等待 splice 的数据 */
+struct outItem{
+    // 内存数据，NULL 表示管道数据
+    sharedBuf *buf;
+    // 内存数据已发送的偏移
+    size_t pos;
+    // 管道数据所属的传输，以及剩余字节数
+    struct transfer *transfer;
+    size_t left;
+    struct outItem *next;
+};
+
+/**
+ * 文件传输: 发送方的数据块 splice 进内核管道，再由管道 splice 给接收方，不经过用户态缓冲区.
+ * 发送方最多可以有 TRANSFER_WINDOW 字节未被确认 (declared - relayed)，聊天消息不会被大文件阻塞.
+ * 管道容量按缓冲页计算，splice 进来的小数据段可能在窗口用完前就占满管道，
+ * 此时暂停读取发送方，接收方取走数据后再恢复.
+ */
+struct transfer{
+    int id;
+    // 发送方 / 接收方，NULL 表示已断开
+    struct client *from;
+    struct client *to;
+    // 中转管道
+    int pipe[2];
+    // 文件大小
+    uint64_t size;
+    // 发送方已声明(/chunk)的字节数
+    uint64_t declared;
+    // 已进入管道的字节数
+    uint64_t received;
+    // 已发送给接收方的字节数
+    uint64_t relayed;
+};
+
+/**
+ * 客户端会话，连接断开后保留 SESSION_TIMEOUT 秒，客户端可以凭 token 恢复.
+ * 发往会话的每条消息分配递增的序号，并保留最近 SESSION_BACKLOG 条,
+ * 重连时只需重放客户端缺少的部分. 最早一条保留消息的序号为 next_seq - backlog_count.
+ */
+struct session{
+    char token[SESSION_TOKEN_LEN + 1];
+    // 当前连接，NULL 表示已断开等待恢复
+    struct client *client;
+    // 断开期间保存的昵称与订阅状态
+    char *nick_name;
+    int presence_sub;
+    // 断开前是否已公告加入(连接可能在公告前就断开)
+    int announced;
+    // 断开的时间(微秒)
+    uint64_t detached_us;
+    // 下一条消息的序号，从 1 开始
+    uint64_t next_seq;
+    // 最近消息环形队列
+    sharedBuf *backlog[SESSION_BACKLOG];
+    int backlog_first;
+    int backlog_count;
+};
+
+/**
+ * 预先序列化的在线列表快照，由 加入/改名/退出 增量维护，/who 只需一次发送.
+ * buf 布局: [预留的头部空间 PRESENCE_HEADER_MAX][" - nick\n" ...]
+ * 头部 "Online (N):\n" 右对齐写入预留空间的末尾，与列表内容相连.
+ */
+struct presence{
+    char *buf;
+    // buf 容量
+    size_t cap;
+    // 列表内容长度(不含头部)
+    size_t body_len;
+    // 头部在 buf 中的起始位置
+    size_t header_start;
+    // 在线人数
+    int count;
+    // 发送用的共享快照，所有 /who 回复(包括会话重放队列)共用一份; 列表变化时释放，下次 /who 再生成
+    sharedBuf *snapshot;
+};
+
+/**
+ * 已关闭但仍有零拷贝发送未完成的连接.
+ * 内核仍在从锁定的页面发送数据，fd 保持打开以读取完成通知，收齐后再关闭并释放缓冲区.
+ */
+struct zeroCopyLinger{
+    // -1 表示已强制中断，等待最后一次释放
+    int fd;
+    zeroCopyState zc;
+    uint64_t deadline_us;
+    struct zeroCopyLinger *next;
+};
+
+/* 延迟直方图，单位纳秒 */
+struct latencyHist{
+    uint64_t buckets[LATENCY_BUCKETS];
+    // 样本数
+    uint64_t samples;
+    // 最大值
+    uint64_t max;
 };
 
 /* 全局状态体 */
 struct chatState{
-    //  server socket fd
-    int server_sock;
+    // server listening socket fds (TCP IPv4 / IPv6 / Unix)
+    int listeners[MAX_LISTENERS];
+    // 监听端点数量
+    int num_listeners;
     // 当前已建立连接的客户端数量
     int num_clients;
     // 当前最大客户端连接 fd
     int max_client;
+    // 消息长度达到该值时使用零拷贝发送，0 表示关闭
+    int zerocopy_threshold;
+    // 在线列表快照
+    struct presence presence;
+    // 所有会话
+    struct session *sessions[MAX_SESSIONS];
+    int num_sessions;
+    // 等待关闭的慢客户端数量
+    int num_close_asap;
+    // 进行中的文件传输
+    struct transfer *transfers[MAX_TRANSFERS];
+    int num_transfers;
+    int next_transfer_id;
+    // 管道腾出空间后等待继续处理缓冲输入的发送方数量
+    int num_input_pending;
+    // 等待零拷贝完成通知的已关闭连接
+    struct zeroCopyLinger *zc_linger;
+    // 流量捕获文件，NULL 表示未开启
+    FILE *capture;
+    // 上一条捕获记录的时间(微秒)
+    uint64_t capture_last_us;
+    // 低延迟模式绑定的 CPU，-1 表示默认模式
+    int latency_cpu;
+    // 低延迟模式的 epoll 实例，-1 表示未使用
+    int epfd;
+    // recv -> send 延迟统计: 内核收到数据 -> 处理完成、回复已写入 socket
+    struct latencyHist latency;
+    // 处理耗时统计: 读到数据之后 -> 处理完成 (回放时只有这一项)
+    struct latencyHist handler;
+    // 上次输出延迟统计 / 执行 serverCron 的时间(微秒)
+    uint64_t latency_report_us;
+    uint64_t cron_last_us;
+    // 是否正在回放，回放时服务端逻辑使用捕获记录的时钟(微秒)
+    int replaying;
+    uint64_t replay_clock_us;
+    // 回放时下一个会话使用的 token (来自 CAPTURE_TOKEN 记录，空串表示没有)，以及没有记录时的生成序号
+    char replay_token[SESSION_TOKEN_LEN + 1];
+    uint64_t replay_token_seq;
     // client list
     struct client* clients[MAX_CLIENTS];
 };
 
+uint64_t ustime(void);
+uint64_t serverTime(void);
+void closeSlowClients(void);
+void processPendingInput(void);
+void latencyEnableTimestamps(int fd);
+void captureEvent(int type, int id, char *data, size_t len);
+void clientUpdateEvents(struct client *client);
+void transferRelayed(struct transfer *transfer, size_t n);
+ssize_t Splice(int in, int out, size_t len);
+
+/* ============================================================================
+ * Client output
+ * ========================================================================== */
+
+/**
+ * 将数据放入客户端输出队列，等待 socket 可写.
+ * 内存数据超过 CLIENT_OUTPUT_LIMIT 时不再入队，标记客户端由事件循环关闭:
+ * 之后的消息都不再写入，客户端不会收到残缺的消息流，开启会话的客户端重连后从会话中重放.
+ */
+void clientQueue(struct client *client, sharedBuf *buf, size_t pos, struct transfer *transfer, size_t left){
+    if (buf && client->out_bytes + buf->len - pos > CLIENT_OUTPUT_LIMIT){
+        if (!client->close_asap){
+            client->close_asap = 1;
+            Chat->num_close_asap++;
+        }
+        return;
+    }
+    struct outItem *item = chatMalloc(sizeof(*item));
+    item->buf = buf ? sharedBufRetain(buf) : NULL;
+    item->pos = pos;
+    item->transfer = transfer;
+    item->left = left;
+    item->next = NULL;
+    if (client->out_tail)
+        client->out_tail->next = item;
+    else
+        client->out_head = item;
+    client->out_tail = item;
+    if (buf)
+        client->out_bytes += buf->len - pos;
+    clientUpdateEvents(client);
+}
+
+/**
+ * 向客户端发送共享缓冲区: 输出队列为空时直接写(大消息零拷贝)，未写完的部分入队;
+ * 队列不为空时为保证顺序直接入队.
+ */
+void clientWriteShared(struct client *client, sharedBuf *buf){
+    ssize_t n = 0;
+    if (client->close_asap)
+        return;
+    if (client->out_head == NULL){
+        if (client->zc.enabled && buf->len >= (size_t)Chat->zerocopy_threshold)
+            n = zeroCopySend(client->fd, &client->zc, buf);
+        else
+            n = Write(client->fd, buf->data, buf->len);
+        if (n == (ssize_t)buf->len)
+            return;
+        if (n == -1){
+            // 连接出错，由读事件负责关闭
+            if (errno != EAGAIN)
+                return;
+            n = 0;
+        }
+    }
+    clientQueue(client, buf, n, NULL, 0);
+}
+
+/**
+ * 向客户端发送一段数据
+ */
+void clientWrite(struct client *client, char *data, size_t len){
+    if (client->close_asap)
+        return;
+    if (client->out_head == NULL){
+        ssize_t n = Write(client->fd, data, len);
+        if (n == (ssize_t)len || (n == -1 && errno != EAGAIN))
+            return;
+        if (n > 0){
+            data += n;
+            len -= n;
+        }
+    }
+    sharedBuf *buf = sharedBufCreate(data, len);
+    clientQueue(client, buf, 0, NULL, 0);
+    sharedBufRelease(buf);
+}
+
+/**
+ * socket 可写时按顺序发送输出队列中的数据
+ */
+void clientFlush(struct client *client){
+    while (client->out_head){
+        struct outItem *item = client->out_head;
+        ssize_t n;
+        if (item->buf){
+            if ((n = Write(client->fd, item->buf->data + item->pos, item->buf->len - item->pos)) <= 0)
+                break;
+            item->pos += n;
+            client->out_bytes -= n;
+            if (item->pos < item->buf->len)
+                break;
+            sharedBufRelease(item->buf);
+        }else{
+            if ((n = Splice(item->transfer->pipe[0], client->fd, item->left)) <= 0)
+                break;
+            item->left -= n;
+            // 可能完成传输并释放 transfer，之后不能再访问 item->transfer
+            transferRelayed(item->transfer, n);
+            if (item->left > 0)
+                break;
+        }
+        client->out_head = item->next;
+        if (client->out_head == NULL)
+            client->out_tail = NULL;
+        free(item);
+    }
+    clientUpdateEvents(client);
+}
+
+/**
+ * 释放输出队列
+ */
+void clientFreeOutput(struct client *client){
+    while (client->out_head){
+        struct outItem *item = client->out_head;
+        client->out_head = item->next;
+        if (item->buf)
+            sharedBufRelease(item->buf);
+        free(item);
+    }
+    client->out_tail = NULL;
+    client->out_bytes = 0;
+}
+
+/**
+ * 向会话当前连接发送一条带序号的消息，帧格式: ":<seq> <len>\n<payload>"
+ */
+void sessionDeliver(struct client *client, uint64_t seq, sharedBuf *buf){
+    char header[48];
+    int header_len = snprintf(header, sizeof(header), ":%llu %zu\n", (unsigned long long)seq, buf->len);
+    if (client->close_asap)
+        return;
+    if (client->out_head || (client->zc.enabled && buf->len >= (size_t)Chat->zerocopy_threshold)){
+        // 头部在栈上，不能零拷贝发送
+        clientWrite(client, header, header_len);
+        clientWriteShared(client, buf);
+        return;
+    }
+    struct iovec iov[2] = {
+        { .iov_base = header, .iov_len = header_len },
+        { .iov_base = buf->data, .iov_len = buf->len },
+    };
+    ssize_t n;
+    do {
+        n = writev(client->fd, iov, 2);
+    } while (n == -1 && errno == EINTR);
+    if (n == (ssize_t)(header_len + buf->len) || (n == -1 && errno != EAGAIN))
+        return;
+    // 未写完的部分放入输出队列
+    if (n == -1)
+        n = 0;
+    if (n < header_len){
+        clientWrite(client, header + n, header_len - n);
+        n = header_len;
+    }
+    clientQueue(client, buf, n - header_len, NULL, 0);
+}
+
+/**
+ * 为消息分配序号并放入会话的最近消息队列，会话在线时立即发送
+ */
+void sessionAppend(struct session *session, sharedBuf *buf){
+    if (session->backlog_count == SESSION_BACKLOG){
+        // 队列已满，丢弃最早的消息
+        sharedBufRelease(session->backlog[session->backlog_first]);
+        session->backlog_first = (session->backlog_first + 1) % SESSION_BACKLOG;
+        session->backlog_count--;
+    }
+    session->backlog[(session->backlog_first + session->backlog_count) % SESSION_BACKLOG] = sharedBufRetain(buf);
+    session->backlog_count++;
+    uint64_t seq = session->next_seq++;
+    if (session->client)
+        sessionDeliver(session->client, seq, buf);
+}
+
+/**
+ * 向客户端发送共享缓冲区中的消息
+ */
+void clientSendShared(struct client *client, sharedBuf *buf){
+    if (client->session)
+        sessionAppend(client->session, buf);
+    else
+        clientWriteShared(client, buf);
+}
+
+/**
+ * 向客户端发送一条消息，开启会话的客户端会加上序号并保留用于重放
+ */
+void clientSend(struct client *client, char *msg, size_t len){
+    if (client->session == NULL){
+        clientWrite(client, msg, len);
+        return;
+    }
+    sharedBuf *buf = sharedBufCreate(msg, len);
+    sessionAppend(client->session, buf);
+    sharedBufRelease(buf);
+}
+
+/**
+ * 重新生成快照头部，人数变化时调用
+ */
+void presenceUpdateHeader(void){
+    struct presence *pr = &Chat->presence;
+    char header[PRESENCE_HEADER_MAX];
+    int len = snprintf(header, sizeof(header), "Online (%d):\n", pr->count);
+    pr->header_start = PRESENCE_HEADER_MAX - len;
+    memcpy(pr->buf + pr->header_start, header, len);
+}
+
+/**
+ * 查找昵称对应的列表项，返回其在列表内容中的偏移，不存在返回-1
+ */
+ssize_t presenceFind(char *nick){
+    struct presence *pr = &Chat->presence;
+    char *body = pr->buf + PRESENCE_HEADER_MAX;
+    size_t nick_len = strlen(nick);
+    size_t pos = 0;
+    while (pos < pr->body_len){
+        char *eol = memchr(body + pos, '\n', pr->body_len - pos);
+        size_t entry_len = eol - (body + pos) + 1;
+        // 列表项格式: " - nick\n"
+        if (entry_len == nick_len + 4 && !memcmp(body + pos + 3, nick, nick_len))
+            return pos;
+        pos += entry_len;
+    }
+    return -1;
+}
+
+/**
+ * 将列表内容中 [pos, pos + old_len) 替换为 " - nick\n"，nick 为 NULL 表示删除
+ */
+void presenceSplice(size_t pos, size_t old_len, char *nick){
+    struct presence *pr = &Chat->presence;
+    // 已发出的快照仍被输出队列/会话引用，不能原地修改
+    if (pr->snapshot){
+        sharedBufRelease(pr->snapshot);
+        pr->snapshot = NULL;
+    }
+    size_t new_len = nick ? strlen(nick) + 4 : 0;
+    size_t need = PRESENCE_HEADER_MAX + pr->body_len - old_len + new_len;
+    if (need > pr->cap){
+        pr->cap = need * 2;
+        pr->buf = chatRealloc(pr->buf, pr->cap);
+    }
+    char *body = pr->buf + PRESENCE_HEADER_MAX;
+    memmove(body + pos + new_len, body + pos + old_len, pr->body_len - pos - old_len);
+    if (nick){
+        memcpy(body + pos, " - ", 3);
+        memcpy(body + pos + 3, nick, new_len - 4);
+        body[pos + new_len - 1] = '\n';
+    }
+    pr->body_len = pr->body_len - old_len + new_len;
+}
+
+/**
+ * 返回在线列表的共享快照，列表变化后第一次调用时重新生成
+ */
+sharedBuf* presenceSnapshot(void){
+    struct presence *pr = &Chat->presence;
+    if (pr->snapshot == NULL)
+        pr->snapshot = sharedBufCreate(pr->buf + pr->header_start, PRESENCE_HEADER_MAX - pr->header_start + pr->body_len);
+    return pr->snapshot;
+}
+
+/**
+ * 将在线列表变更推送给订阅者，断开等待恢复的订阅会话也会保留该变更
+ */
+void presenceNotify(char *delta, size_t len){
+    sharedBuf *buf = sharedBufCreate(delta, len);
+    for (int j = 0; j <= Chat->max_client; j++){
+        if (Chat->clients[j] && Chat->clients[j]->presence_sub)
+            clientSendShared(Chat->clients[j], buf);
+    }
+    for (int j = 0; j < Chat->num_sessions; j++){
+        if (Chat->sessions[j]->client == NULL && Chat->sessions[j]->presence_sub)
+            sessionAppend(Chat->sessions[j], buf);
+    }
+    sharedBufRelease(buf);
+}
+
+/* 玩家加入 */
+void presenceAdd(char *nick){
+    struct presence *pr = &Chat->presence;
+    presenceSplice(pr->body_len, 0, nick);
+    pr->count++;
+    presenceUpdateHeader();
+
+    char delta[strlen(nick) + 16];
+    int len = snprintf(delta, sizeof(delta), "[presence] +%s\n", nick);
+    presenceNotify(delta, len);
+}
+
+/* 玩家退出 */
+void presenceRemove(char *nick){
+    struct presence *pr = &Chat->presence;
+    ssize_t pos = presenceFind(nick);
+    if (pos == -1)
+        return;
+    presenceSplice(pos, strlen(nick) + 4, NULL);
+    pr->count--;
+    presenceUpdateHeader();
+
+    char delta[strlen(nick) + 16];
+    int len = snprintf(delta, sizeof(delta), "[presence] -%s\n", nick);
+    presenceNotify(delta, len);
+}
+
+/* 玩家改名，原位置替换 */
+void presenceRename(char *old_nick, char *new_nick){
+    ssize_t pos = presenceFind(old_nick);
+    if (pos == -1)
+        return;
+    presenceSplice(pos, strlen(old_nick) + 4, new_nick);
+
+    char delta[strlen(old_nick) + strlen(new_nick) + 16];
+    int len = snprintf(delta, sizeof(delta), "[presence] ~%s %s\n", old_nick, new_nick);
+    presenceNotify(delta, len);
+}
+
 /**
  * 将新建立的连接(fd)，封装为一个客户端实例
  */
@@ -57,10 +622,28 @@ struct client* create_client(int client_fd){
     // 初始化客户端
     struct client* client = chatMalloc(sizeof(*client));
     socketSetNonBlockNoDelay(client_fd);
+    latencyEnableTimestamps(client_fd);
     client->fd = client_fd;
+    // 开启零拷贝发送，不支持时(如 Unix 域套接字)退化为普通写
+    if (Chat->zerocopy_threshold <= 0 || zeroCopyEnable(client_fd, &client->zc) == -1)
+        memset(&client->zc, 0, sizeof(client->zc));
     // 设置昵称
     client->nick_name = chatMalloc(nick_len + 1);
-    memcpy(client->nick_name, nick, nick_len);
+    memcpy(client->nick_name, nick, nick_len + 1);
+    client->presence_sub = 0;
+    client->session = NULL;
+    client->announced = 0;
+    client->connected_us = serverTime();
+    client->out_head = client->out_tail = NULL;
+    client->out_bytes = 0;
+    client->want_write = 0;
+    client->want_read = 1;
+    client->read_paused = 0;
+    client->close_asap = 0;
+    client->in_buf = NULL;
+    client->in_len = client->in_cap = 0;
+    client->chunk_transfer = NULL;
+    client->chunk_left = 0;
     // 将连接放入客户端列表
     assert(Chat->clients[client->fd] == NULL);
     Chat->clients[client->fd] = client;
@@ -72,29 +655,136 @@ struct client* create_client(int client_fd){
 }
 
 /**
- * 将消息发送给所有客户端(发送者除外)
+ * 将消息发送给所有客户端(发送者除外)，断开等待恢复的会话也会保留该消息.
+ * 大消息使用零拷贝发送，所有接收者共享同一份缓冲区，内核全部发送完成后释放.
  */
 void sendMessageToAllClientsBut(int sender, char* msg, size_t msg_len){
+    sharedBuf *shared = NULL;
+    if (Chat->num_sessions > 0 || (Chat->zerocopy_threshold > 0 && msg_len >= (size_t)Chat->zerocopy_threshold))
+        shared = sharedBufCreate(msg, msg_len);
     for (int j = 0; j <= Chat->max_client; j++){
         if (Chat->clients[j] == NULL || Chat->clients[j]->fd == sender) continue;
-        write(Chat->clients[j]->fd, msg, msg_len);
+        if (shared)
+            clientSendShared(Chat->clients[j], shared);
+        else
+            clientWrite(Chat->clients[j], msg, msg_len);
+    }
+    for (int j = 0; j < Chat->num_sessions; j++){
+        if (Chat->sessions[j]->client == NULL)
+            sessionAppend(Chat->sessions[j], shared);
     }
+    if (shared)
+        sharedBufRelease(shared);
+}
+
+/**
+ * 公告客户端加入: 加入在线列表并广播进入通知
+ */
+void announceClient(struct client* client){
+    if (client->announced)
+        return;
+    client->announced = 1;
+    presenceAdd(client->nick_name);
+    char notify_msg[strlen(client->nick_name) + 24];
+    int notify_len = snprintf(notify_msg, sizeof(notify_msg), "Player [%s] enter Chat!\n", client->nick_name);
+    sendMessageToAllClientsBut(client->fd, notify_msg, notify_len);
 }
 
 
 /**
- * 关闭客户端,释放资源.
+ * 广播玩家退出通知，并移出在线列表
  */
-void closeClient(struct client* client){
-    Info("Disconnected client fd = %d, nick = %s", client->fd, client->nick_name);
-    // 广播退出通知消息
-    char notify_message[sizeof(client->nick_name) + 24];
-    int notify_len = snprintf(notify_message, sizeof(notify_message), "Player [%s] Quit Chat!\n", client->nick_name);
-    sendMessageToAllClientsBut(client->fd, notify_message, notify_len);
+void announceQuit(int sender, char *nick){
+    char notify_message[strlen(nick) + 24];
+    int notify_len = snprintf(notify_message, sizeof(notify_message), "Player [%s] Quit Chat!\n", nick);
+    sendMessageToAllClientsBut(sender, notify_message, notify_len);
+    presenceRemove(nick);
+}
 
-    free(client->nick_name);
-    close(client->fd);
+/**
+ * 释放会话
+ */
+void sessionFree(struct session *session){
+    for (int j = 0; j < Chat->num_sessions; j++){
+        if (Chat->sessions[j] == session){
+            Chat->sessions[j] = Chat->sessions[--Chat->num_sessions];
+            break;
+        }
+    }
+    for (int j = 0; j < session->backlog_count; j++)
+        sharedBufRelease(session->backlog[(session->backlog_first + j) % SESSION_BACKLOG]);
+    free(session->nick_name);
+    free(session);
+}
+
+void transferAbortClient(struct client *client);
+
+/**
+ * 关闭客户端 socket. 若仍有零拷贝发送未完成，缓冲区还不能释放，
+ * 先 shutdown 让对端收到 FIN，fd 挂到等待列表，由 serverCron 收取完成通知后再关闭.
+ */
+void zeroCopyClose(int fd, zeroCopyState *zc){
+    if (zc->count > 0)
+        zeroCopyReap(fd, zc);
+    if (zc->count == 0){
+        close(fd);
+        return;
+    }
+#ifdef __linux__
+    if (Chat->epfd != -1)
+        epoll_ctl(Chat->epfd, EPOLL_CTL_DEL, fd, NULL);
+#endif
+    shutdown(fd, SHUT_RDWR);
+    struct zeroCopyLinger *linger = chatMalloc(sizeof(*linger));
+    linger->fd = fd;
+    linger->zc = *zc;
+    linger->deadline_us = serverTime() + ZEROCOPY_LINGER_TIMEOUT * 1000000ULL;
+    linger->next = Chat->zc_linger;
+    Chat->zc_linger = linger;
+    zc->count = 0;
+}
+
+/**
+ * 收取等待列表中的零拷贝完成通知，全部完成的连接关闭并释放.
+ * 超时仍未完成(对端一直不接收)则以 RST 中断连接，内核会丢弃发送队列，
+ * 在下一轮再释放缓冲区，留出时间让网卡发完已经提交的数据包.
+ */
+void zeroCopyLingerCron(uint64_t now){
+    struct zeroCopyLinger **p = &Chat->zc_linger;
+    while (*p){
+        struct zeroCopyLinger *linger = *p;
+        if (linger->fd != -1){
+            zeroCopyReap(linger->fd, &linger->zc);
+            if (linger->zc.count > 0 && now >= linger->deadline_us){
+                struct linger lg = {1, 0};
+                setsockopt(linger->fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+                close(linger->fd);
+                linger->fd = -1;
+                p = &linger->next;
+                continue;
+            }
+            if (linger->zc.count > 0){
+                p = &linger->next;
+                continue;
+            }
+            close(linger->fd);
+        }
+        zeroCopyReset(&linger->zc);
+        *p = linger->next;
+        free(linger);
+    }
+}
+
+/**
+ * 释放客户端连接资源，不发送任何通知
+ */
+void freeClient(struct client* client){
     Chat->clients[client->fd] = NULL;
+    clientFreeOutput(client);
+    transferAbortClient(client);
+    free(client->nick_name);
+    free(client->in_buf);
+    zeroCopyClose(client->fd, &client->zc);
     Chat->num_clients--;
     // 如果关闭的是最大客户端，则找出新的最大客户端并且更新
     if (Chat->max_client == client->fd){
@@ -112,7 +802,198 @@ void closeClient(struct client* client){
     free(client);
 }
 
+/**
+ * 关闭客户端,释放资源，会话也一并结束.
+ */
+void closeClient(struct client* client){
+    Info("Disconnected client fd = %d, nick = %s", client->fd, client->nick_name);
+    if (client->announced){
+        // 先移出 clients 列表，自己不会再收到通知
+        Chat->clients[client->fd] = NULL;
+        announceQuit(client->fd, client->nick_name);
+    }
+    if (client->session)
+        sessionFree(client->session);
+    freeClient(client);
+}
+
+/**
+ * 连接断开: 开启会话的客户端保留会话等待恢复，不广播退出通知; 否则直接关闭.
+ */
+void disconnectClient(struct client* client){
+    struct session *session = client->session;
+    if (session == NULL){
+        closeClient(client);
+        return;
+    }
+    Info("Detached client fd = %d, nick = %s, session kept for %ds", client->fd, client->nick_name, SESSION_TIMEOUT);
+    session->client = NULL;
+    session->nick_name = client->nick_name;
+    session->presence_sub = client->presence_sub;
+    session->announced = client->announced;
+    session->detached_us = serverTime();
+    client->nick_name = NULL;
+    freeClient(client);
+}
+
+/**
+ * 断开的会话超时: 已公告加入的广播退出通知，然后释放
+ */
+void sessionExpire(struct session *session){
+    Info("Session of %s expired", session->nick_name);
+    if (session->announced)
+        announceQuit(-1, session->nick_name);
+    sessionFree(session);
+}
+
+/**
+ * 生成随机的会话 token.
+ * 回放时沿用捕获中记录的 token，旧的捕获文件没有记录时按序号生成，保证回放结果确定.
+ */
+void sessionGenToken(char *token){
+    if (Chat->replaying){
+        if (Chat->replay_token[0]){
+            memcpy(token, Chat->replay_token, SESSION_TOKEN_LEN + 1);
+            Chat->replay_token[0] = 0;
+        }else{
+            snprintf(token, SESSION_TOKEN_LEN + 1, "%0*llx", SESSION_TOKEN_LEN, (unsigned long long)++Chat->replay_token_seq);
+        }
+        return;
+    }
+    unsigned char bytes[SESSION_TOKEN_LEN / 2];
+    int fd = open("/dev/urandom", O_RDONLY);
+    if (fd == -1 || read(fd, bytes, sizeof(bytes)) != sizeof(bytes)){
+        for (size_t j = 0; j < sizeof(bytes); j++)
+            bytes[j] = random() & 0xff;
+    }
+    if (fd != -1)
+        close(fd);
+    for (size_t j = 0; j < sizeof(bytes); j++)
+        snprintf(token + j * 2, 3, "%02x", bytes[j]);
+}
+
+/**
+ * 为客户端创建会话，回复 "!session <token>"
+ */
+void sessionCreate(struct client* client){
+    if (Chat->num_sessions == MAX_SESSIONS){
+        // 会话已满，淘汰断开最久的会话
+        struct session *oldest = NULL;
+        for (int j = 0; j < Chat->num_sessions; j++){
+            struct session *s = Chat->sessions[j];
+            if (s->client == NULL && (oldest == NULL || s->detached_us < oldest->detached_us))
+                oldest = s;
+        }
+        if (oldest == NULL){
+            char *errmsg = "!session-full\n";
+            clientWrite(client, errmsg, strlen(errmsg));
+            return;
+        }
+        sessionExpire(oldest);
+    }
+    struct session *session = chatMalloc(sizeof(*session));
+    memset(session, 0, sizeof(*session));
+    sessionGenToken(session->token);
+    captureEvent(CAPTURE_TOKEN, client->fd, session->token, SESSION_TOKEN_LEN);
+    session->next_seq = 1;
+    session->client = client;
+    client->session = session;
+    Chat->sessions[Chat->num_sessions++] = session;
+
+    char reply[SESSION_TOKEN_LEN + 16];
+    int reply_len = snprintf(reply, sizeof(reply), "!session %s\n", session->token);
+    clientWrite(client, reply, reply_len);
+}
+
+/**
+ * 凭 token 恢复断开的会话，并重放序号大于 last_seq 的消息.
+ * 会话不存在或已过期时回复 "!expired"，客户端应重新创建会话.
+ */
+void sessionResume(struct client* client, char *token, uint64_t last_seq){
+    struct session *session = NULL;
+    for (int j = 0; j < Chat->num_sessions; j++){
+        if (!strcmp(Chat->sessions[j]->token, token)){
+            session = Chat->sessions[j];
+            break;
+        }
+    }
+    if (session == NULL || session->client != NULL || client->session != NULL){
+        char *errmsg = "!expired\n";
+        clientWrite(client, errmsg, strlen(errmsg));
+        return;
+    }
+
+    // 新连接接管会话，沿用会话中的昵称; 会话已公告过加入则不再公告
+    if (client->announced){
+        Chat->clients[client->fd] = NULL;
+        announceQuit(client->fd, client->nick_name);
+        Chat->clients[client->fd] = client;
+    }
+    free(client->nick_name);
+    client->nick_name = session->nick_name;
+    client->presence_sub = session->presence_sub;
+    client->announced = session->announced;
+    client->session = session;
+    session->nick_name = NULL;
+    session->client = client;
+    Info("Resumed session of %s on fd = %d", client->nick_name, client->fd);
+
+    char reply[SESSION_TOKEN_LEN + 16];
+    int reply_len = snprintf(reply, sizeof(reply), "!resumed %s\n", session->token);
+    clientWrite(client, reply, reply_len);
+
+    // 重放客户端缺少的消息，已被挤出队列的部分告知客户端
+    uint64_t oldest = session->next_seq - session->backlog_count;
+    if (last_seq + 1 < oldest){
+        reply_len = snprintf(reply, sizeof(reply), "!gap %llu %llu\n",
+            (unsigned long long)last_seq + 1, (unsigned long long)oldest - 1);
+        clientWrite(client, reply, reply_len);
+    }
+    for (int j = 0; j < session->backlog_count; j++){
+        uint64_t seq = oldest + j;
+        if (seq > last_seq)
+            sessionDeliver(client, seq, session->backlog[(session->backlog_first + j) % SESSION_BACKLOG]);
+    }
+}
+
+
+
+/**
+ * 根据端点描述创建一个监听 socket，失败返回-1.
+ * 支持的格式:
+ *  - unix:/path 或 /path   Unix 域套接字
+ *  - [addr]:port           IPv6 地址
+ *  - addr:port             IPv4 地址
+ *  - port                  所有 IPv4 地址
+ */
+int createListener(char *endpoint){
+    char host[64];
+    char *sep;
+
+    if (strncmp(endpoint, "unix:", 5) == 0)
+        return createUnixServer(endpoint + 5);
+    if (endpoint[0] == '/')
+        return createUnixServer(endpoint);
 
+    if (endpoint[0] == '['){
+        // IPv6: [addr]:port
+        sep = strstr(endpoint, "]:");
+        if (sep == NULL || sep - endpoint - 1 >= (int)sizeof(host))
+            return -1;
+        memcpy(host, endpoint + 1, sep - endpoint - 1);
+        host[sep - endpoint - 1] = 0;
+        return createTCPServer(host, atoi(sep + 2));
+    }
+    if ((sep = strrchr(endpoint, ':')) != NULL){
+        // IPv4: addr:port
+        if (sep - endpoint >= (int)sizeof(host))
+            return -1;
+        memcpy(host, endpoint, sep - endpoint);
+        host[sep - endpoint] = 0;
+        return createTCPServer(host, atoi(sep + 1));
+    }
+    return createTCPServer(NULL, atoi(endpoint));
+}
 
 /**
  * 初始化服务端全局状态数据
@@ -123,144 +1004,1299 @@ void initChat(void){
     memset(Chat, 0, sizeof(*Chat));
     Chat->max_client = -1;
     Chat->num_clients = 0;
-    // Create server listening socket
-    Chat->server_sock = createTCPServer(SERVER_PORT);
-    if (Chat->server_sock == -1){
-        perror("Creating listening socket");
-        exit(1);
-    }
+    Chat->num_listeners = 0;
+    Chat->capture = NULL;
+    Chat->latency_cpu = -1;
+    Chat->epfd = -1;
+    // 初始化空的在线列表快照
+    Chat->presence.cap = PRESENCE_HEADER_MAX + 1024;
+    Chat->presence.buf = chatMalloc(Chat->presence.cap);
+    Chat->presence.body_len = 0;
+    Chat->presence.count = 0;
+    Chat->presence.snapshot = NULL;
+    presenceUpdateHeader();
 }
 
 /**
- * Chat Server
- * 
+ * 创建所有监听端点
+ *
+ * @param endpoints 监听端点列表，为空时监听默认端口
  */
-int main(void){
-    // 初始化服务端
-    initChat();
-    // event loop
-    while (1){
-        // 需要被 select 监听的描述符集合
-        fd_set listen_fds;
-        // 设置 select 监听超时时间为 1s
-        struct timeval timeout;
-        timeout.tv_sec = 1;
-        timeout.tv_usec = 0;
-        // 每次 select 的结果
-        int retval;
-
-        // 清除集合，并将 服务监听socket放入集合
-        FD_ZERO(&listen_fds);
-        FD_SET(Chat->server_sock, &listen_fds);
-        // 将所有客户端连接 socket 放入集合
-        for (int j = 0; j <= Chat->max_client; j++){
-            if (Chat->clients[j])
-                FD_SET(j, &listen_fds);
+void initListeners(char **endpoints, int num_endpoints){
+    // Create server listening sockets
+    if (num_endpoints == 0){
+        Chat->listeners[Chat->num_listeners] = createTCPServer(NULL, SERVER_PORT);
+        if (Chat->listeners[Chat->num_listeners] == -1){
+            perror("Creating listening socket");
+            exit(1);
         }
-        // 本次要监听最大fd
-        int listen_max_fd = Chat->max_client;
-        if (listen_max_fd < Chat->server_sock) listen_max_fd = Chat->server_sock;
-
-        // select listen
-        retval = select(listen_max_fd + 1, &listen_fds, NULL, NULL, &timeout);
-        if (retval == -1){
-            // 错误处理
-            if (errno == EINTR) {
-                // 可能由于信号而被打断
-                Error("server listening interrupt dut to signal");
-                continue;
-            };
-            perror("select () error");
+        Info("Listening on 0.0.0.0:%d", SERVER_PORT);
+        Chat->num_listeners++;
+        return;
+    }
+    for (int j = 0; j < num_endpoints; j++){
+        int fd = createListener(endpoints[j]);
+        if (fd == -1){
+            Error("Creating listening socket %s: %s", endpoints[j], strerror(errno));
             exit(1);
-        }else if (retval){
-            // 服务端 socket 就绪
-            if (FD_ISSET(Chat->server_sock, &listen_fds)){
-                int fd = acceptClient(Chat->server_sock);
-                struct client* client = create_client(fd);
-
-                // 回复欢迎消息
-                char *welcome_message =
-                    "Welcome to Small Chat! \n"
-                    "Use /nike <nick> to set your nick. \n";
-                write(client->fd, welcome_message, strlen(welcome_message));
-                Info("Connected client fd = %d", fd);
-
-                // 广播玩家进入通知消息
-                char notify_msg[sizeof(client->nick_name) + 24];
-                int notify_len = snprintf(notify_msg, sizeof(notify_msg), "Player [%s] enter Chat!\n", client->nick_name);
-                sendMessageToAllClientsBut(fd, notify_msg, notify_len);
-            }
-
-            char buf[256];
-            // 遍历检查是否有客户端发送数据
-            for (int j = 0; j <= Chat->max_client; j++){
-                if (Chat->clients[j] == NULL)
-                    continue;
-                // 处理事件就绪的客户端
-                if (FD_ISSET(j, &listen_fds)){
-                    struct client* client = Chat->clients[j];
-                    int nread = read(j, buf, sizeof(buf) - 1);
-                    if (nread <= 0){
-                        // 客户端关闭
-                        closeClient(client);
-                    }else{
-                        buf[nread] = 0;
-                        // 发送的是命令，处理命令，目前只支持修改昵称 '/nike <>' 
-                        if (buf[0] == '/'){
-                            // 清除尾行的换行符等
-                            char *p;
-                            p = strchr(buf, '\r'); if (p) *p = 0;
-                            p = strchr(buf, '\n'); if (p) *p = 0;
-                            
-                            // 获取客户端要修改的新名称
-                            char *new_nick = strchr(buf, ' ');
-                            if (new_nick){
-                                *new_nick = 0;
-                                new_nick++;
-                            }
-                            if (!strcmp(buf, "/nick") && new_nick){
-                                // 构建通知消息
-                                ssize_t old_len = strlen(client->nick_name);
-                                ssize_t new_len = strlen(new_nick);
-                                char notify_msg[30 + old_len + new_len];
-                                int msg_len = snprintf(notify_msg, sizeof(notify_msg), "Player [%s] rename [%s]\n", client->nick_name, new_nick);
-
-                                // 修改客户端昵称
-                                free(client->nick_name);
-                                client->nick_name = chatMalloc(new_len + 1);
-                                memcpy(client->nick_name, new_nick, new_len + 1);
-                                char succmsg[] = "\n Rename success.\n\n";
-                                write(client->fd, succmsg, sizeof(succmsg));
-                                sendMessageToAllClientsBut(client->fd, notify_msg, msg_len);
-                            }else{
-                                // 不支持的命令
-                                char *errmsg = "\n Sorry Unsupported Command.\n\n";
-                                write(client->fd, errmsg, strlen(errmsg));
-                            }
-                        }else{
-                            if (strlen(buf) == strlen(EXIT) && strncmp(buf, EXIT, strlen(EXIT)) == 0) {                                                                // 客户端关闭
-                                closeClient(client);
-                                continue;
-                            }
-                            // 发送的是消息，广播给其他客户端
-                            // 消息格式： 发送者> 消息内容
-                            // 总消息大小：消息长度 + 昵称长度 + 1(换行符) 
-                            char message[nread + sizeof(client->nick_name) + 1];
-                            int message_len = snprintf(message, sizeof(message), "%s> %s", client->nick_name, buf);
-                            // snprintf 返回值可能大于 sizeof(message)
-                            if (message_len >= (int)sizeof(message)){
-                                message_len = sizeof(message) - 1;
-                            }
-                            printf("%s", message);
-                            sendMessageToAllClientsBut(j, message, message_len);
-                        }
-                    }
-                }
-            }
-        }else{
-            // select 监听超时
-            // Debug("server listen timeout...");
         }
+        Info("Listening on %s", endpoints[j]);
+        Chat->listeners[Chat->num_listeners++] = fd;
     }
-    return 0;
-}
\ No newline at end of file
+}
+
+
+/* ============================================================================
+ * File transfer
+ *
+ * 发送方: /send <nick> <size> <name>  ->  !send <id> <window> 或 !send-error <reason>
+ *         /chunk <id> <len>\n<len 字节>  (未确认字节数不超过 window)
+ *         /chunk-abort <id>  发送方放弃传输
+ *         <-  !ack <id> <n>  数据已转发给接收方，归还窗口
+ *         <-  !send-done <id> / !send-abort <id>
+ * 接收方: <-  !file <id> <from> <size> <name>
+ *         <-  !data <id> <len>\n<len 字节>
+ *         <-  !file-done <id> / !file-abort <id>
+ * ========================================================================== */
+
+/**
+ * 在两个描述符之间移动数据(至少一端为管道)，不经过用户态. 返回值与 Read 一致.
+ */
+ssize_t Splice(int in, int out, size_t len){
+#ifdef __linux__
+    ssize_t n;
+reset:
+    if ((n = splice(in, NULL, out, NULL, len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK)) == -1){
+        if (errno == EINTR)
+            goto reset;
+    }
+    return n;
+#else
+    (void)in;
+    (void)out;
+    (void)len;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/**
+ * 向传输的一方发送控制消息
+ */
+void transferNotify(struct client *client, char *fmt, int id){
+    char msg[64];
+    int len = snprintf(msg, sizeof(msg), fmt, id);
+    clientWrite(client, msg, len);
+}
+
+struct transfer* transferFind(int id){
+    for (int j = 0; j < Chat->num_transfers; j++){
+        if (Chat->transfers[j]->id == id)
+            return Chat->transfers[j];
+    }
+    return NULL;
+}
+
+/**
+ * 发送方不再向该传输写入: 数据块剩余部分直接丢弃，因管道已满暂停的读取也随之恢复
+ */
+void transferResumeSender(struct client *client){
+    client->chunk_transfer = NULL;
+    client->read_paused = 0;
+    clientUpdateEvents(client);
+}
+
+void transferFree(struct transfer *transfer){
+    for (int j = 0; j < Chat->num_transfers; j++){
+        if (Chat->transfers[j] == transfer){
+            Chat->transfers[j] = Chat->transfers[--Chat->num_transfers];
+            break;
+        }
+    }
+    // 发送方可能还有未收完的数据块，之后的数据直接丢弃
+    if (transfer->from && transfer->from->chunk_transfer == transfer)
+        transferResumeSender(transfer->from);
+    close(transfer->pipe[0]);
+    close(transfer->pipe[1]);
+    free(transfer);
+}
+
+/**
+ * 发送方退出传输(断开或写入管道失败): 管道中已有的数据先转发给接收方，之后再通知中止
+ */
+void transferDetachSender(struct transfer *transfer){
+    if (transfer->from && transfer->from->chunk_transfer == transfer)
+        transferResumeSender(transfer->from);
+    transfer->from = NULL;
+    if (transfer->relayed == transfer->received){
+        Info("Transfer %d aborted", transfer->id);
+        transferNotify(transfer->to, "!file-abort %d\n", transfer->id);
+        transferFree(transfer);
+    }
+}
+
+/**
+ * 处理 /send <nick> <size> <name>: 创建传输并通知接收方
+ */
+void transferStart(struct client *client, char *args){
+    char *nick = args, *size_str, *name;
+    struct client *to = NULL;
+    char *err = NULL;
+
+    if (args == NULL || (size_str = strchr(nick, ' ')) == NULL || (name = strchr(size_str + 1, ' ')) == NULL){
+        err = "!send-error usage: /send <nick> <size> <name>\n";
+        goto error;
+    }
+    *size_str++ = 0;
+    *name++ = 0;
+    uint64_t size = strtoull(size_str, NULL, 10);
+    for (int j = 0; j <= Chat->max_client; j++){
+        struct client *c = Chat->clients[j];
+        if (c && c != client && c->announced && !strcmp(c->nick_name, nick)){
+            to = c;
+            break;
+        }
+    }
+    if (to == NULL){
+        err = "!send-error no such player\n";
+        goto error;
+    }
+    // 接收方必须能解析带长度的数据帧
+    if (to->session == NULL){
+        err = "!send-error player can not receive files\n";
+        goto error;
+    }
+    if (size == 0 || Chat->num_transfers == MAX_TRANSFERS){
+        err = "!send-error transfer rejected\n";
+        goto error;
+    }
+
+    struct transfer *transfer = chatMalloc(sizeof(*transfer));
+    if (pipe(transfer->pipe) == -1){
+        free(transfer);
+        err = "!send-error transfer rejected\n";
+        goto error;
+    }
+    fcntl(transfer->pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(transfer->pipe[1], F_SETFL, O_NONBLOCK);
+#ifdef F_SETPIPE_SZ
+    fcntl(transfer->pipe[1], F_SETPIPE_SZ, TRANSFER_WINDOW);
+#endif
+    transfer->id = ++Chat->next_transfer_id;
+    transfer->from = client;
+    transfer->to = to;
+    transfer->size = size;
+    transfer->declared = transfer->received = transfer->relayed = 0;
+    Chat->transfers[Chat->num_transfers++] = transfer;
+    Info("Transfer %d: %s -> %s, %s (%llu bytes)", transfer->id, client->nick_name, to->nick_name, name, (unsigned long long)size);
+
+    {
+        char msg[strlen(client->nick_name) + strlen(name) + 64];
+        int len = snprintf(msg, sizeof(msg), "!file %d %s %llu %s\n", transfer->id, client->nick_name, (unsigned long long)size, name);
+        clientWrite(to, msg, len);
+        len = snprintf(msg, sizeof(msg), "!send %d %d\n", transfer->id, TRANSFER_WINDOW);
+        clientWrite(client, msg, len);
+    }
+    return;
+
+error:
+    clientWrite(client, err, strlen(err));
+}
+
+/**
+ * 处理 /chunk <id> <len>: 之后的 len 字节为文件数据.
+ * 传输不存在时回复中止并丢弃这部分数据; 超出窗口或文件大小时同时中止传输，接收方收到 !file-abort.
+ */
+void transferChunk(struct client *client, char *args){
+    int id = 0;
+    unsigned long long len = 0;
+    sscanf(args, "%d %llu", &id, &len);
+    struct transfer *transfer = transferFind(id);
+
+    client->chunk_left = len;
+    client->chunk_transfer = NULL;
+    if (transfer == NULL || transfer->from != client){
+        transferNotify(client, "!send-abort %d\n", id);
+        return;
+    }
+    if (transfer->declared + len > transfer->size || transfer->declared + len - transfer->relayed > TRANSFER_WINDOW){
+        Error("Transfer %d: window exceeded", transfer->id);
+        transferNotify(client, "!send-abort %d\n", transfer->id);
+        transferDetachSender(transfer);
+        return;
+    }
+    transfer->declared += len;
+    client->chunk_transfer = transfer;
+}
+
+/**
+ * 处理 /chunk-abort <id>: 发送方放弃传输(例如读取文件失败)
+ */
+void transferCancel(struct client *client, char *args){
+    struct transfer *transfer = args ? transferFind(atoi(args)) : NULL;
+    if (transfer == NULL || transfer->from != client)
+        return;
+    Info("Transfer %d cancelled by sender", transfer->id);
+    transferDetachSender(transfer);
+}
+
+/**
+ * n 字节数据已进入管道: 为接收方排队一个数据帧
+ */
+void transferQueued(struct transfer *transfer, size_t n){
+    transfer->received += n;
+    // 接收方即将因输出超限被关闭，传输随之中止
+    if (transfer->to->close_asap)
+        return;
+    char header[48];
+    int header_len = snprintf(header, sizeof(header), "!data %d %zu\n", transfer->id, n);
+    clientWrite(transfer->to, header, header_len);
+    clientQueue(transfer->to, NULL, 0, transfer, n);
+    clientFlush(transfer->to);
+}
+
+/**
+ * 接收已经读入用户态的数据块数据(与命令一起读到的部分，或回放)，写入管道.
+ * 返回消费的字节数，小于 len 表示管道已满，剩余数据由调用方保留，接收方取走数据后再重试.
+ */
+size_t transferReceive(struct client *client, char *data, size_t len){
+    struct transfer *transfer = client->chunk_transfer;
+    if (transfer == NULL){
+        client->chunk_left -= len;
+        return len;
+    }
+    ssize_t n = Write(transfer->pipe[1], data, len);
+    if (n <= 0)
+        return 0;
+    client->chunk_left -= n;
+    transferQueued(transfer, n);
+    return n;
+}
+
+/**
+ * 数据块的剩余部分直接从 socket splice 进管道，返回移动的字节数，0 表示连接关闭
+ */
+ssize_t transferSpliceIn(struct client *client){
+    struct transfer *transfer = client->chunk_transfer;
+    ssize_t n;
+    if (transfer == NULL){
+        // 丢弃数据
+        char discard[4096];
+        n = Read(client->fd, discard, client->chunk_left < sizeof(discard) ? client->chunk_left : sizeof(discard));
+        if (n > 0)
+            client->chunk_left -= n;
+        return n;
+    }
+    if ((n = Splice(client->fd, transfer->pipe[1], client->chunk_left)) <= 0){
+        // socket 中还有数据却无法移动，说明管道已满: 暂停读取，避免事件循环空转
+        int pending;
+        if (n == -1 && errno == EAGAIN && ioctl(client->fd, FIONREAD, &pending) == 0 && pending > 0){
+            client->read_paused = 1;
+            clientUpdateEvents(client);
+            errno = EAGAIN;
+        }
+        return n;
+    }
+    client->chunk_left -= n;
+    transferQueued(transfer, n);
+    return n;
+}
+
+/**
+ * n 字节已发送给接收方: 归还发送方窗口，全部完成后结束传输
+ */
+void transferRelayed(struct transfer *transfer, size_t n){
+    transfer->relayed += n;
+    // 管道腾出了空间，恢复读取发送方; 缓冲区中未写入管道的数据由事件循环稍后继续处理，
+    // 这里可能正处于发送方输入的处理过程中，不能重入
+    if (transfer->from && transfer->from->read_paused){
+        transfer->from->read_paused = 0;
+        clientUpdateEvents(transfer->from);
+        if (transfer->from->in_len > 0)
+            Chat->num_input_pending++;
+    }
+    if (transfer->from){
+        char ack[48];
+        int len = snprintf(ack, sizeof(ack), "!ack %d %zu\n", transfer->id, n);
+        clientWrite(transfer->from, ack, len);
+    }
+    if (transfer->relayed == transfer->size){
+        Info("Transfer %d done", transfer->id);
+        transferNotify(transfer->to, "!file-done %d\n", transfer->id);
+        if (transfer->from)
+            transferNotify(transfer->from, "!send-done %d\n", transfer->id);
+        transferFree(transfer);
+    }else if (transfer->from == NULL && transfer->relayed == transfer->received){
+        // 发送方已断开，管道中的数据已全部转发
+        transferNotify(transfer->to, "!file-abort %d\n", transfer->id);
+        transferFree(transfer);
+    }
+}
+
+/**
+ * 客户端是否是某个进行中传输的发送方
+ */
+int transferIsSender(struct client *client){
+    for (int j = 0; j < Chat->num_transfers; j++){
+        if (Chat->transfers[j]->from == client)
+            return 1;
+    }
+    return 0;
+}
+
+/**
+ * 在尚未读取的输入 data 中查找第一个 "/chunk " 命令行，返回该行结束后的位置，没有时返回 len.
+ * 输入缓冲区中不完整的行是 data 中第一行的开头.
+ */
+size_t transferHeaderEnd(struct client *client, char *data, size_t len){
+    size_t pos = 0;
+    while (pos < len){
+        char *eol = memchr(data + pos, '\n', len - pos);
+        if (eol == NULL)
+            break;
+        size_t end = eol - data + 1;
+        // 拼出行首的 7 个字节
+        char head[7];
+        size_t head_len = 0;
+        if (pos == 0){
+            head_len = client->in_len < sizeof(head) ? client->in_len : sizeof(head);
+            memcpy(head, client->in_buf, head_len);
+        }
+        size_t more = end - pos < sizeof(head) - head_len ? end - pos : sizeof(head) - head_len;
+        memcpy(head + head_len, data + pos, more);
+        head_len += more;
+        if (head_len == sizeof(head) && !memcmp(head, "/chunk ", sizeof(head)))
+            return end;
+        pos = end;
+    }
+    return len;
+}
+
+/**
+ * 客户端断开时结束与其相关的传输
+ */
+void transferAbortClient(struct client *client){
+    // 释放时会与末尾交换，因此倒序遍历
+    for (int j = Chat->num_transfers - 1; j >= 0; j--){
+        struct transfer *transfer = Chat->transfers[j];
+        if (transfer->to == client){
+            Info("Transfer %d aborted", transfer->id);
+            if (transfer->from)
+                transferNotify(transfer->from, "!send-abort %d\n", transfer->id);
+            transferFree(transfer);
+        }else if (transfer->from == client){
+            transferDetachSender(transfer);
+        }
+    }
+}
+
+
+/* ============================================================================
+ * Client event handlers
+ * ========================================================================== */
+
+/**
+ * 处理新建立的客户端连接: 回复欢迎消息，并广播进入通知
+ */
+struct client* handleClientConnect(int fd){
+    struct client* client = create_client(fd);
+
+    // 回复欢迎消息
+    char *welcome_message =
+        "Welcome to Small Chat! \n"
+        "Use /nike <nick> to set your nick. \n"
+        "Use /who to list online players. \n";
+    clientWrite(client, welcome_message, strlen(welcome_message));
+    Info("Connected client fd = %d", fd);
+
+    // 进入通知延迟到客户端首次发送数据或 CLIENT_ANNOUNCE_DELAY 之后,
+    // 断线重连的客户端会先发送 /resume，从而避免重复的 进入/退出 通知
+    return client;
+}
+
+/**
+ * 处理客户端发送的一行数据，buf 以 '\0' 结尾
+ */
+void handleClientInput(struct client* client, char* buf, int nread){
+    if (!client->announced && strncmp(buf, "/session", 8) && strncmp(buf, "/resume", 7))
+        announceClient(client);
+    // 发送的是命令，处理命令，支持修改昵称 '/nick <>'、在线列表 '/who [sub|unsub]'
+    // 以及会话 '/session'、'/resume <token> <last_seq>'
+    if (buf[0] == '/'){
+        // 清除尾行的换行符等
+        char *p;
+        p = strchr(buf, '\r'); if (p) *p = 0;
+        p = strchr(buf, '\n'); if (p) *p = 0;
+        
+        // 获取客户端要修改的新名称
+        char *new_nick = strchr(buf, ' ');
+        if (new_nick){
+            *new_nick = 0;
+            new_nick++;
+        }
+        if (!strcmp(buf, "/nick") && new_nick){
+            // 构建通知消息
+            ssize_t old_len = strlen(client->nick_name);
+            ssize_t new_len = strlen(new_nick);
+            char notify_msg[30 + old_len + new_len];
+            int msg_len = snprintf(notify_msg, sizeof(notify_msg), "Player [%s] rename [%s]\n", client->nick_name, new_nick);
+
+            // 修改客户端昵称
+            presenceRename(client->nick_name, new_nick);
+            free(client->nick_name);
+            client->nick_name = chatMalloc(new_len + 1);
+            memcpy(client->nick_name, new_nick, new_len + 1);
+            char succmsg[] = "\n Rename success.\n\n";
+            clientSend(client, succmsg, sizeof(succmsg));
+            sendMessageToAllClientsBut(client->fd, notify_msg, msg_len);
+        }else if (!strcmp(buf, "/who")){
+            // 参数复用 new_nick: sub 订阅变更 / unsub 取消订阅 / 无参数返回快照
+            if (new_nick && !strcmp(new_nick, "sub")){
+                client->presence_sub = 1;
+            }else if (new_nick && !strcmp(new_nick, "unsub")){
+                client->presence_sub = 0;
+            }
+            clientSendShared(client, presenceSnapshot());
+        }else if (!strcmp(buf, "/send")){
+#ifdef __linux__
+            transferStart(client, new_nick);
+#else
+            char *errmsg = "!send-error unsupported\n";
+            clientWrite(client, errmsg, strlen(errmsg));
+#endif
+        }else if (!strcmp(buf, "/chunk-abort")){
+            transferCancel(client, new_nick);
+        }else if (!strcmp(buf, "/session")){
+            if (client->session == NULL)
+                sessionCreate(client);
+        }else if (!strcmp(buf, "/resume") && new_nick){
+            // 参数: <token> <last_seq>
+            char *seq = strchr(new_nick, ' ');
+            if (seq)
+                *seq++ = 0;
+            sessionResume(client, new_nick, seq ? strtoull(seq, NULL, 10) : 0);
+            // 恢复失败，或恢复的会话在公告前就断开了
+            if (!client->announced)
+                announceClient(client);
+        }else{
+            // 不支持的命令
+            char *errmsg = "\n Sorry Unsupported Command.\n\n";
+            clientSend(client, errmsg, strlen(errmsg));
+        }
+    }else{
+        if (strlen(buf) == strlen(EXIT) && strncmp(buf, EXIT, strlen(EXIT)) == 0) {
+            // 客户端关闭
+            closeClient(client);
+            return;
+        }
+        // 发送的是消息，广播给其他客户端
+        // 消息格式： 发送者> 消息内容
+        // 总消息大小：消息长度 + 昵称长度 + 1(换行符) 
+        char message[nread + sizeof(client->nick_name) + 1];
+        int message_len = snprintf(message, sizeof(message), "%s> %s", client->nick_name, buf);
+        // snprintf 返回值可能大于 sizeof(message)
+        if (message_len >= (int)sizeof(message)){
+            message_len = sizeof(message) - 1;
+        }
+        printf("%s", message);
+        sendMessageToAllClientsBut(client->fd, message, message_len);
+    }
+}
+
+/**
+ * 处理客户端发送的数据: 追加到输入缓冲区后按行切分.
+ * "/chunk <id> <len>" 行之后的 len 字节为文件数据，交给传输; 其余每一行交给 handleClientInput.
+ * 不完整的行留在缓冲区等待后续数据，超过 CLIENT_MAX_LINE 仍没有换行时按一行处理.
+ */
+void processClientInput(struct client* client, char* data, size_t len){
+    int fd = client->fd;
+    if (client->in_len + len + 1 > client->in_cap){
+        client->in_cap = (client->in_len + len + 1) * 2;
+        client->in_buf = chatRealloc(client->in_buf, client->in_cap);
+    }
+    if (len > 0)
+        memcpy(client->in_buf + client->in_len, data, len);
+    client->in_len += len;
+
+    size_t pos = 0;
+    while (pos < client->in_len){
+        char *line = client->in_buf + pos;
+        size_t avail = client->in_len - pos;
+        // 正在接收数据块
+        if (client->chunk_left > 0){
+            size_t n = avail < client->chunk_left ? avail : client->chunk_left;
+            size_t consumed = transferReceive(client, line, n);
+            pos += consumed;
+            if (consumed < n){
+                // 管道已满: 剩余数据留在缓冲区，暂停读取，接收方取走数据后由 processPendingInput 继续
+                client->read_paused = 1;
+                clientUpdateEvents(client);
+                break;
+            }
+            continue;
+        }
+        char *eol = memchr(line, '\n', avail);
+        size_t line_len;
+        if (eol)
+            line_len = eol - line + 1;
+        else if (avail >= CLIENT_MAX_LINE)
+            line_len = avail;
+        else
+            break;
+        // 行以 '\0' 结尾，处理完再恢复被覆盖的下一行首字节
+        char next = line[line_len];
+        line[line_len] = 0;
+        pos += line_len;
+        if (!strncmp(line, "/chunk ", 7)){
+            transferChunk(client, line + 7);
+        }else{
+            handleClientInput(client, line, line_len);
+            // 客户端已关闭，缓冲区已随之释放
+            if (Chat->clients[fd] != client)
+                return;
+        }
+        line[line_len] = next;
+    }
+    // 移除已处理的数据; 仍在接收数据块且缓冲区为空时，之后的数据可以直接 splice
+    memmove(client->in_buf, client->in_buf + pos, client->in_len - pos);
+    client->in_len -= pos;
+}
+
+
+/* ============================================================================
+ * Latency mode && metrics
+ *
+ * 低延迟模式: 事件循环线程绑定到指定 CPU，非阻塞 epoll_wait 忙轮询并为
+ * 客户端 socket 开启 SO_BUSY_POLL，同时预先缺页并锁定工作内存.
+ * 两种模式都会统计 "内核收到数据(SO_TIMESTAMPNS) -> 回复写入 socket" 的延迟分布，包括事件循环被唤醒、
+ * 调用 recv 之前的等待时间，以及单独的处理耗时，并定期输出分位数.
+ * ========================================================================== */
+
+/**
+ * 返回单调时钟的当前微秒数
+ */
+uint64_t ustime(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * 返回服务端逻辑(公告延迟、会话超时等)使用的当前时间(微秒).
+ * 回放时为捕获记录的时间，使回放的行为与录制时一致，不受回放速度影响.
+ */
+uint64_t serverTime(void){
+    return Chat->replaying ? Chat->replay_clock_us : ustime();
+}
+
+/**
+ * 返回单调时钟的当前纳秒数
+ */
+uint64_t nstime(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * 纳秒值映射到直方图桶: 小于 LATENCY_SUB_BUCKETS 的值每个值一个桶,
+ * 之后每个 2 的幂区间再线性划分为 LATENCY_SUB_BUCKETS 个桶(相对误差约 6%).
+ */
+int latencyBucket(uint64_t ns){
+    if (ns < LATENCY_SUB_BUCKETS)
+        return ns;
+    int exp = 63 - __builtin_clzll(ns);
+    int sub = (ns >> (exp - LATENCY_SUB_BITS)) & (LATENCY_SUB_BUCKETS - 1);
+    return (exp - LATENCY_SUB_BITS + 1) * LATENCY_SUB_BUCKETS + sub;
+}
+
+/* 桶对应的最小纳秒值 */
+uint64_t latencyBucketValue(int bucket){
+    if (bucket < LATENCY_SUB_BUCKETS)
+        return bucket;
+    int exp = bucket / LATENCY_SUB_BUCKETS + LATENCY_SUB_BITS - 1;
+    int sub = bucket % LATENCY_SUB_BUCKETS;
+    return ((uint64_t)1 << exp) | ((uint64_t)sub << (exp - LATENCY_SUB_BITS));
+}
+
+/**
+ * 返回实时时钟的当前纳秒数，与内核接收时间戳(SO_TIMESTAMPNS)使用同一时钟
+ */
+uint64_t realnstime(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * 为 socket 开启内核接收时间戳，recvmsg 时随数据返回
+ */
+void latencyEnableTimestamps(int fd){
+#ifdef SO_TIMESTAMPNS
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on));
+#else
+    (void)fd;
+#endif
+}
+
+/**
+ * 取出 recvmsg 返回的内核接收时间戳(实时时钟纳秒)，没有时返回0 (如 Unix 域套接字)
+ */
+uint64_t latencyRxTimestamp(struct msghdr *msg){
+#ifdef SO_TIMESTAMPNS
+    for (struct cmsghdr *cm = CMSG_FIRSTHDR(msg); cm != NULL; cm = CMSG_NXTHDR(msg, cm)){
+        if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_TIMESTAMPNS){
+            struct timespec ts;
+            memcpy(&ts, CMSG_DATA(cm), sizeof(ts));
+            return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+        }
+    }
+#else
+    (void)msg;
+#endif
+    return 0;
+}
+
+/**
+ * 向直方图记录一个纳秒样本
+ */
+void latencyRecord(struct latencyHist *h, uint64_t ns){
+    h->buckets[latencyBucket(ns)]++;
+    h->samples++;
+    if (ns > h->max) h->max = ns;
+}
+
+/* 返回分位数 q (0~1) 对应的纳秒值 */
+uint64_t latencyPercentile(struct latencyHist *h, double q){
+    uint64_t target = (uint64_t)(q * h->samples), seen = 0;
+    if (target >= h->samples) target = h->samples - 1;
+    for (int j = 0; j < LATENCY_BUCKETS; j++){
+        seen += h->buckets[j];
+        if (seen > target)
+            return latencyBucketValue(j);
+    }
+    return h->max;
+}
+
+/**
+ * 输出并清空一个直方图的分位数
+ */
+void latencyReportHist(struct latencyHist *h, char *name){
+    if (h->samples == 0)
+        return;
+    Info("Latency %s (%s mode, %llu samples): p50=%.1fus p99=%.1fus p99.9=%.1fus max=%.1fus",
+        name, Chat->latency_cpu >= 0 ? "busy-poll" : "select",
+        (unsigned long long)h->samples,
+        latencyPercentile(h, 0.5) / 1000.0, latencyPercentile(h, 0.99) / 1000.0,
+        latencyPercentile(h, 0.999) / 1000.0, h->max / 1000.0);
+    memset(h, 0, sizeof(*h));
+}
+
+/**
+ * 输出并清空当前统计周期的延迟分位数
+ */
+void latencyReport(void){
+    latencyReportHist(&Chat->latency, "recv->send");
+    latencyReportHist(&Chat->handler, "handler");
+}
+
+/**
+ * 周期任务，事件循环大约每秒调用一次
+ */
+void serverCron(void){
+    uint64_t now = serverTime();
+    // 公告一直没有发送数据的新连接
+    for (int j = 0; j <= Chat->max_client; j++){
+        if (Chat->clients[j] && !Chat->clients[j]->announced && now - Chat->clients[j]->connected_us >= CLIENT_ANNOUNCE_DELAY)
+            announceClient(Chat->clients[j]);
+    }
+    // 清理超时的断开会话，释放时会与末尾交换，因此倒序遍历
+    for (int j = Chat->num_sessions - 1; j >= 0; j--){
+        struct session *session = Chat->sessions[j];
+        if (session->client == NULL && now - session->detached_us >= SESSION_TIMEOUT * 1000000ULL)
+            sessionExpire(session);
+    }
+    // 回放结束时统一输出延迟统计
+    if (!Chat->replaying && now - Chat->latency_report_us >= LATENCY_REPORT_INTERVAL * 1000000ULL){
+        latencyReport();
+        Chat->latency_report_us = now;
+    }
+    if (Chat->zc_linger)
+        zeroCopyLingerCron(now);
+}
+
+/**
+ * 进入低延迟模式: 绑定 CPU，预先缺页并锁定内存，创建 epoll 实例.
+ * 绑核/锁内存失败只输出错误(通常是权限不足)，不影响运行.
+ */
+void latencyModeInit(void){
+#ifdef __linux__
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(Chat->latency_cpu, &cpus);
+    if (sched_setaffinity(0, sizeof(cpus), &cpus) == -1)
+        Error("Pinning event loop to CPU %d: %s", Chat->latency_cpu, strerror(errno));
+
+#ifdef __GLIBC__
+    // 不把空闲内存还给系统，也不用 mmap 分配大块，避免之后再次缺页
+    mallopt(M_TRIM_THRESHOLD, -1);
+    mallopt(M_MMAP_MAX, 0);
+#endif
+    // 预先触碰堆与栈，使页面在进入事件循环前全部就绪
+    char *heap = chatMalloc(LATENCY_PREFAULT_HEAP);
+    memset(heap, 0, LATENCY_PREFAULT_HEAP);
+    free(heap);
+    volatile char stack[LATENCY_PREFAULT_STACK];
+    memset((char *)stack, 0, sizeof(stack));
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) == -1)
+        Error("Locking memory: %s", strerror(errno));
+
+    if ((Chat->epfd = epoll_create1(0)) == -1){
+        perror("epoll_create1");
+        exit(1);
+    }
+    for (int j = 0; j < Chat->num_listeners; j++){
+        struct epoll_event ev = { .events = EPOLLIN, .data.fd = Chat->listeners[j] };
+        epoll_ctl(Chat->epfd, EPOLL_CTL_ADD, Chat->listeners[j], &ev);
+    }
+    Info("Latency mode: busy polling on CPU %d", Chat->latency_cpu);
+#else
+    Error("Latency mode is only supported on Linux");
+    exit(1);
+#endif
+}
+
+/**
+ * 低延迟模式下新连接的额外设置: 加入 epoll 并开启 socket 忙轮询
+ */
+void latencyModeAddClient(int fd){
+#ifdef __linux__
+    int busy_poll = LATENCY_BUSY_POLL_US;
+    struct client *client = Chat->clients[fd];
+    client->want_write = client->out_head != NULL;
+    client->want_read = !client->read_paused;
+    struct epoll_event ev = { .events = (client->want_read ? EPOLLIN : 0) | (client->want_write ? EPOLLOUT : 0), .data.fd = fd };
+    setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &busy_poll, sizeof(busy_poll));
+    epoll_ctl(Chat->epfd, EPOLL_CTL_ADD, fd, &ev);
+#else
+    (void)fd;
+#endif
+}
+
+/**
+ * 输出队列 空/非空、读取 暂停/恢复 变化时，更新 epoll 中注册的事件(select 模式每轮重新计算，无需处理)
+ */
+void clientUpdateEvents(struct client *client){
+    int want_write = client->out_head != NULL;
+    int want_read = !client->read_paused;
+    if (want_write == client->want_write && want_read == client->want_read)
+        return;
+    client->want_write = want_write;
+    client->want_read = want_read;
+#ifdef __linux__
+    if (Chat->epfd != -1 && Chat->clients[client->fd] == client){
+        struct epoll_event ev = { .events = (want_read ? EPOLLIN : 0) | (want_write ? EPOLLOUT : 0), .data.fd = client->fd };
+        epoll_ctl(Chat->epfd, EPOLL_CTL_MOD, client->fd, &ev);
+    }
+#endif
+}
+
+
+/* ============================================================================
+ * Traffic capture && replay
+ *
+ * 捕获文件格式: 文件头 CAPTURE_MAGIC，之后是连续的事件记录,
+ * 每条记录为 [type:1字节][client id:varint][距上一条记录的微秒数:varint],
+ * CAPTURE_INPUT / CAPTURE_TOKEN 事件之后还有 [长度:varint][数据]，CAPTURE_SPLICE 事件之后只有 [长度:varint]
+ * (文件数据不经过用户态，回放时以 0 填充). CAPTURE_TOKEN 紧跟在生成它的那条 CAPTURE_INPUT 之后.
+ * varint 为 LEB128 编码.
+ * ========================================================================== */
+
+void captureWriteVarint(uint64_t v){
+    do {
+        unsigned char byte = v & 0x7f;
+        v >>= 7;
+        if (v) byte |= 0x80;
+        fputc(byte, Chat->capture);
+    } while (v);
+}
+
+int captureReadVarint(FILE *fp, uint64_t *v){
+    int c, shift = 0;
+    *v = 0;
+    do {
+        if ((c = fgetc(fp)) == EOF || shift > 63)
+            return -1;
+        *v |= (uint64_t)(c & 0x7f) << shift;
+        shift += 7;
+    } while (c & 0x80);
+    return 0;
+}
+
+/**
+ * 打开捕获文件，之后所有客户端事件都会被记录
+ */
+void captureOpen(char *path){
+    if ((Chat->capture = fopen(path, "wb")) == NULL){
+        perror("Opening capture file");
+        exit(1);
+    }
+    setvbuf(Chat->capture, NULL, _IOFBF, 64 * 1024);
+    fwrite(CAPTURE_MAGIC, 1, strlen(CAPTURE_MAGIC), Chat->capture);
+    Chat->capture_last_us = ustime();
+    Info("Capturing traffic to %s", path);
+}
+
+/**
+ * 记录一个客户端事件
+ */
+void captureEvent(int type, int id, char *data, size_t len){
+    if (Chat->capture == NULL)
+        return;
+    uint64_t now = ustime();
+    fputc(type, Chat->capture);
+    captureWriteVarint(id);
+    captureWriteVarint(now - Chat->capture_last_us);
+    if (type == CAPTURE_INPUT || type == CAPTURE_SPLICE || type == CAPTURE_TOKEN)
+        captureWriteVarint(len);
+    if (type == CAPTURE_INPUT || type == CAPTURE_TOKEN)
+        fwrite(data, 1, len, Chat->capture);
+    Chat->capture_last_us = now;
+}
+
+/**
+ * 每轮事件循环结束时刷新，避免进程被终止时丢失记录
+ */
+void captureFlush(void){
+    if (Chat->capture)
+        fflush(Chat->capture);
+}
+
+/**
+ * 在进程内将捕获文件回放给事件处理函数，客户端输出写入 /dev/null.
+ * 
+ * @param fast 为 1 时不按记录的时间间隔等待，尽可能快地回放
+ */
+void replayCapture(char *path, int fast){
+    FILE *fp;
+    char magic[sizeof(CAPTURE_MAGIC) - 1];
+    // 捕获时的 client id -> 回放时的 fd
+    int fds[MAX_CLIENTS];
+    char *buf = NULL;
+    size_t buf_cap = 0;
+    uint64_t events = 0, bytes = 0, offset = 0;
+
+    if ((fp = fopen(path, "rb")) == NULL){
+        perror("Opening capture file");
+        exit(1);
+    }
+    if (fread(magic, 1, sizeof(magic), fp) != sizeof(magic) || memcmp(magic, CAPTURE_MAGIC, sizeof(magic))){
+        Error("%s is not a capture file", path);
+        exit(1);
+    }
+    for (int j = 0; j < MAX_CLIENTS; j++) fds[j] = -1;
+
+    uint64_t start = ustime();
+    Chat->replaying = 1;
+    Chat->replay_clock_us = 0;
+    Chat->cron_last_us = 0;
+    int type;
+    while ((type = fgetc(fp)) != EOF){
+        uint64_t id, delta, len = 0, token_delta = 0;
+        if (captureReadVarint(fp, &id) == -1 || captureReadVarint(fp, &delta) == -1 || id >= MAX_CLIENTS)
+            goto truncated;
+        if ((type == CAPTURE_INPUT || type == CAPTURE_SPLICE || type == CAPTURE_TOKEN) && captureReadVarint(fp, &len) == -1)
+            goto truncated;
+        if (type == CAPTURE_INPUT || type == CAPTURE_TOKEN){
+            if (len + 1 > buf_cap){
+                buf_cap = len + 1;
+                buf = chatRealloc(buf, buf_cap);
+            }
+            if (fread(buf, 1, len, fp) != len)
+                goto truncated;
+            buf[len] = 0;
+        }
+        // 处理这条输入时生成的 token 记录在它之后，先读出来留给 sessionGenToken
+        if (type == CAPTURE_INPUT){
+            int next;
+            while ((next = fgetc(fp)) == CAPTURE_TOKEN){
+                uint64_t token_id, next_delta, token_len;
+                if (captureReadVarint(fp, &token_id) == -1 || captureReadVarint(fp, &next_delta) == -1 ||
+                    captureReadVarint(fp, &token_len) == -1 || token_len != SESSION_TOKEN_LEN ||
+                    fread(Chat->replay_token, 1, SESSION_TOKEN_LEN, fp) != SESSION_TOKEN_LEN)
+                    goto truncated;
+                Chat->replay_token[SESSION_TOKEN_LEN] = 0;
+                token_delta += next_delta;
+            }
+            if (next != EOF)
+                ungetc(next, fp);
+        }
+        // 按原始节奏回放
+        offset += delta;
+        if (!fast){
+            uint64_t elapsed = ustime() - start;
+            if (offset > elapsed)
+                usleep(offset - elapsed);
+        }
+        // 按记录的时钟每秒执行一次 serverCron: 公告新连接、清理超时会话
+        while (offset - Chat->cron_last_us >= 1000000){
+            Chat->replay_clock_us = Chat->cron_last_us + 1000000;
+            serverCron();
+            Chat->cron_last_us = Chat->replay_clock_us;
+        }
+        Chat->replay_clock_us = offset;
+
+        int fd = fds[id];
+        struct client *client = fd == -1 ? NULL : Chat->clients[fd];
+        switch (type){
+        case CAPTURE_CONNECT:
+            if ((fd = open("/dev/null", O_WRONLY)) == -1 || fd >= MAX_CLIENTS){
+                Error("Replay: can not open /dev/null for client %d", (int)id);
+                exit(1);
+            }
+            fds[id] = fd;
+            handleClientConnect(fd);
+            break;
+        case CAPTURE_INPUT:
+            if (client){
+                uint64_t t0 = nstime();
+                processClientInput(client, buf, len);
+                latencyRecord(&Chat->handler, nstime() - t0);
+            }
+            bytes += len;
+            break;
+        case CAPTURE_SPLICE:
+            // 文件数据以 0 填充，仍然经过管道转发
+            while (client && len > 0 && client->chunk_left > 0){
+                static char zeros[4096];
+                size_t n = len < sizeof(zeros) ? len : sizeof(zeros);
+                if (n > client->chunk_left) n = client->chunk_left;
+                if ((n = transferReceive(client, zeros, n)) == 0)
+                    break;
+                len -= n;
+            }
+            break;
+        case CAPTURE_CLOSE:
+            if (client)
+                disconnectClient(client);
+            fds[id] = -1;
+            break;
+        case CAPTURE_TOKEN:
+            // 未跟在输入之后的 token 没有对应的会话，忽略
+            break;
+        default:
+            goto truncated;
+        }
+        processPendingInput();
+        closeSlowClients();
+        // 没有被使用的 token 不能留给之后的会话
+        Chat->replay_token[0] = 0;
+        offset += token_delta;
+        events++;
+    }
+    goto done;
+
+truncated:
+    Error("Replay: capture file %s is truncated or corrupted", path);
+done:
+    {
+        uint64_t elapsed = ustime() - start;
+        if (elapsed == 0) elapsed = 1;
+        Info("Replayed %llu events (%llu input bytes) in %.3f ms, %.0f events/sec",
+            (unsigned long long)events, (unsigned long long)bytes,
+            elapsed / 1000.0, events * 1000000.0 / elapsed);
+        latencyReport();
+    }
+    free(buf);
+    fclose(fp);
+}
+
+/* ============================================================================
+ * Event loop
+ * ========================================================================== */
+
+/**
+ * 监听 socket 就绪，接收新连接
+ */
+void acceptFromListener(int listener){
+    int fd = acceptClient(listener);
+    if (fd == -1)
+        return;
+    if (fd >= MAX_CLIENTS){
+        Error("Too many clients, reject fd = %d", fd);
+        close(fd);
+        return;
+    }
+    captureEvent(CAPTURE_CONNECT, fd, NULL, 0);
+    handleClientConnect(fd);
+    if (Chat->epfd != -1)
+        latencyModeAddClient(fd);
+}
+
+/**
+ * 客户端 socket 就绪，读取并处理数据
+ */
+void readFromClient(struct client* client){
+    char buf[256];
+    int fd = client->fd;
+    // 零拷贝完成通知会使 socket 可读，先处理错误队列
+    if (client->zc.count > 0)
+        zeroCopyReap(fd, &client->zc);
+    // 缓冲区中还有等待写入管道的数据块数据，必须先于 socket 中的数据处理
+    if (client->chunk_left > 0 && client->in_len > 0){
+        processClientInput(client, NULL, 0);
+        return;
+    }
+    // 正在接收数据块，直接 splice 进传输管道
+    if (client->chunk_left > 0){
+        ssize_t n = transferSpliceIn(client);
+        if (n == -1 && errno == EAGAIN)
+            return;
+        if (n <= 0){
+            captureEvent(CAPTURE_CLOSE, fd, NULL, 0);
+            disconnectClient(client);
+        }else{
+            captureEvent(CAPTURE_SPLICE, fd, NULL, n);
+        }
+        return;
+    }
+    // 通过 recvmsg 取得内核收到数据的时间戳
+    struct iovec iov = { .iov_base = buf, .iov_len = sizeof(buf) - 1 };
+    union {
+        char buf[CMSG_SPACE(sizeof(struct timespec))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    // 发送文件时先窥探数据，只读到 /chunk 命令行为止，之后的文件数据留在 socket 中直接 splice
+    int sending = transferIsSender(client);
+    int nread = recvmsg(fd, &msg, sending ? MSG_PEEK : 0);
+    if (nread == -1 && errno == EAGAIN)
+        return;
+    if (sending && nread > 0)
+        nread = read(fd, buf, transferHeaderEnd(client, buf, nread));
+    if (nread <= 0){
+        // 客户端关闭
+        captureEvent(CAPTURE_CLOSE, fd, NULL, 0);
+        disconnectClient(client);
+    }else{
+        uint64_t rx = latencyRxTimestamp(&msg);
+        uint64_t t0 = nstime();
+        buf[nread] = 0;
+        captureEvent(CAPTURE_INPUT, fd, buf, nread);
+        processClientInput(client, buf, nread);
+        latencyRecord(&Chat->handler, nstime() - t0);
+        // 处理过程中回复已写入 socket(或进入输出队列)
+        if (rx){
+            uint64_t now = realnstime();
+            if (now > rx)
+                latencyRecord(&Chat->latency, now - rx);
+        }
+    }
+}
+
+/**
+ * 继续处理因传输管道已满而留在输入缓冲区的数据.
+ * 管道腾出空间时(transferRelayed)只恢复读取并计数，到这里统一处理，避免在处理发送方输入的过程中重入.
+ */
+void processPendingInput(void){
+    if (Chat->num_input_pending == 0)
+        return;
+    Chat->num_input_pending = 0;
+    for (int j = 0; j <= Chat->max_client; j++){
+        struct client *client = Chat->clients[j];
+        if (client && !client->read_paused && client->chunk_left > 0 && client->in_len > 0)
+            processClientInput(client, NULL, 0);
+    }
+}
+
+/**
+ * 关闭输出队列超限的慢客户端. 超限时只做标记，到这里统一关闭，避免在广播遍历客户端的过程中释放客户端.
+ * 关闭时广播的退出通知可能使其他客户端也超限，计数不为 0 时下一轮继续处理.
+ */
+void closeSlowClients(void){
+    if (Chat->num_close_asap == 0)
+        return;
+    Chat->num_close_asap = 0;
+    for (int j = 0; j <= Chat->max_client; j++){
+        struct client *client = Chat->clients[j];
+        if (client == NULL || !client->close_asap)
+            continue;
+        Info("Client fd = %d exceeded the output limit", client->fd);
+        captureEvent(CAPTURE_CLOSE, client->fd, NULL, 0);
+        disconnectClient(client);
+    }
+}
+
+/**
+ * 默认事件循环: select 阻塞等待，超时时间 1s
+ */
+void selectLoop(void){
+    while (1){
+        // 需要被 select 监听的描述符集合，以及输出队列不为空、需要等待可写的描述符
+        fd_set listen_fds, write_fds;
+        // 设置 select 监听超时时间为 1s
+        struct timeval timeout;
+        timeout.tv_sec = 1;
+        timeout.tv_usec = 0;
+        // 每次 select 的结果
+        int retval;
+
+        // 清除集合，并将 服务监听socket放入集合
+        FD_ZERO(&listen_fds);
+        FD_ZERO(&write_fds);
+        for (int j = 0; j < Chat->num_listeners; j++)
+            FD_SET(Chat->listeners[j], &listen_fds);
+        // 将所有客户端连接 socket 放入集合
+        for (int j = 0; j <= Chat->max_client; j++){
+            if (Chat->clients[j] && !Chat->clients[j]->read_paused)
+                FD_SET(j, &listen_fds);
+            if (Chat->clients[j] && Chat->clients[j]->out_head)
+                FD_SET(j, &write_fds);
+        }
+        // 本次要监听最大fd
+        int listen_max_fd = Chat->max_client;
+        for (int j = 0; j < Chat->num_listeners; j++)
+            if (listen_max_fd < Chat->listeners[j]) listen_max_fd = Chat->listeners[j];
+
+        // select listen
+        retval = select(listen_max_fd + 1, &listen_fds, &write_fds, NULL, &timeout);
+        if (retval == -1){
+            // 错误处理
+            if (errno == EINTR) {
+                // 可能由于信号而被打断
+                Error("server listening interrupt dut to signal");
+                continue;
+            };
+            perror("select () error");
+            exit(1);
+        }else if (retval){
+            // 服务端 socket 就绪
+            for (int l = 0; l < Chat->num_listeners; l++){
+                if (FD_ISSET(Chat->listeners[l], &listen_fds))
+                    acceptFromListener(Chat->listeners[l]);
+            }
+            // 遍历检查是否有客户端发送数据
+            for (int j = 0; j <= Chat->max_client; j++){
+                // 处理事件就绪的客户端
+                if (Chat->clients[j] != NULL && FD_ISSET(j, &listen_fds))
+                    readFromClient(Chat->clients[j]);
+                // 可写，继续发送输出队列
+                if (Chat->clients[j] != NULL && FD_ISSET(j, &write_fds))
+                    clientFlush(Chat->clients[j]);
+            }
+            captureFlush();
+        }else{
+            // select 监听超时
+            // Debug("server listen timeout...");
+        }
+        if (ustime() - Chat->cron_last_us >= 1000000){
+            serverCron();
+            Chat->cron_last_us = ustime();
+        }
+        processPendingInput();
+        closeSlowClients();
+    }
+}
+
+/**
+ * 低延迟事件循环: 非阻塞 epoll_wait 持续自旋，用 CPU 换取尾延迟
+ */
+void busyPollLoop(void){
+#ifdef __linux__
+    struct epoll_event events[MAX_EVENTS];
+    while (1){
+        int n = epoll_wait(Chat->epfd, events, MAX_EVENTS, 0);
+        if (n == -1){
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait () error");
+            exit(1);
+        }
+        for (int j = 0; j < n; j++){
+            int fd = events[j].data.fd;
+            int l;
+            for (l = 0; l < Chat->num_listeners; l++){
+                if (Chat->listeners[l] == fd)
+                    break;
+            }
+            if (l < Chat->num_listeners){
+                acceptFromListener(fd);
+                continue;
+            }
+            if (Chat->clients[fd] != NULL && (events[j].events & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+                readFromClient(Chat->clients[fd]);
+            if (Chat->clients[fd] != NULL && (events[j].events & EPOLLOUT))
+                clientFlush(Chat->clients[fd]);
+        }
+        if (n > 0)
+            captureFlush();
+        if (ustime() - Chat->cron_last_us >= 1000000){
+            serverCron();
+            Chat->cron_last_us = ustime();
+        }
+        processPendingInput();
+        closeSlowClients();
+    }
+#endif
+}
+
+/**
+ * Chat Server
+ * 
+ */
+int main(int argc, char **args){
+    // 解析命令行参数: -l <endpoint> 可以指定多次
+    char *endpoints[MAX_LISTENERS];
+    int num_endpoints = 0;
+    int zerocopy_threshold = 0;
+    char *capture_path = NULL, *replay_path = NULL;
+    int replay_fast = 0;
+    int latency_cpu = -1;
+    for (int j = 1; j < argc; j++){
+        if (!strcmp(args[j], "-l") && j + 1 < argc && num_endpoints < MAX_LISTENERS){
+            endpoints[num_endpoints++] = args[++j];
+        }else if (!strcmp(args[j], "-z") && j + 1 < argc){
+            // 零拷贝只对较大的消息有收益，建议 >= 10KB
+            zerocopy_threshold = atoi(args[++j]);
+        }else if (!strcmp(args[j], "-w") && j + 1 < argc){
+            capture_path = args[++j];
+        }else if (!strcmp(args[j], "-r") && j + 1 < argc){
+            replay_path = args[++j];
+        }else if (!strcmp(args[j], "-f")){
+            replay_fast = 1;
+        }else if (!strcmp(args[j], "-L") && j + 1 < argc){
+            // 低延迟模式，事件循环绑定到指定 CPU
+            latency_cpu = atoi(args[++j]);
+        }else{
+            printf("Usage: %s [-l <port|addr:port|[addr6]:port|unix:/path>]... [-z <zerocopy-min-bytes>]\n"
+                   "          [-w <capture-file>] [-r <capture-file> [-f]] [-L <cpu>]\n", args[0]);
+            exit(1);
+        }
+    }
+    // 初始化服务端
+    initChat();
+    Chat->zerocopy_threshold = zerocopy_threshold;
+    Chat->latency_cpu = latency_cpu;
+    // 回放模式: 不监听任何端点，回放结束后退出
+    if (replay_path){
+        replayCapture(replay_path, replay_fast);
+        return 0;
+    }
+    initListeners(endpoints, num_endpoints);
+    if (capture_path)
+        captureOpen(capture_path);
+    // event loop
+    if (Chat->latency_cpu >= 0){
+        latencyModeInit();
+        busyPollLoop();
+    }else{
+        selectLoop();
+    }
+    return 0;
+}